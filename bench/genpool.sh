@@ -0,0 +1,119 @@
+#!/bin/sh
+#
+# Synthesize a pool of valid, installable-looking Archlinux packages for
+# benchmarking repose. Everything is generated locally; the packages
+# only carry empty files, so generation is bound by tar and the
+# compressor rather than by the data.
+
+set -e
+
+usage() {
+    cat <<USAGE
+usage: ${0##*/} [options] <pool>
+Options
+ -n COUNT       number of distinct packages (default: 1000)
+ -v VERSIONS    versions of each package to generate (default: 1)
+ -f FILES       files in each package (default: 20)
+ -c COMPRESS    gz, xz or zst (default: xz)
+ -s             write a detached .sig beside every package
+ -o OFFSET      start numbering packages at OFFSET (default: 0)
+USAGE
+    exit "${1:-1}"
+}
+
+count=1000
+versions=1
+files=20
+compress=xz
+sign=0
+offset=0
+
+while getopts 'n:v:f:c:so:h' opt; do
+    case $opt in
+        n) count=$OPTARG ;;
+        v) versions=$OPTARG ;;
+        f) files=$OPTARG ;;
+        c) compress=$OPTARG ;;
+        s) sign=1 ;;
+        o) offset=$OPTARG ;;
+        h) usage 0 ;;
+        *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+[ $# -eq 1 ] || usage
+pool=$1
+
+case $compress in
+    gz)  compressor='gzip -n -c' ;;
+    xz)  compressor='xz -c -T1' ;;
+    zst) compressor='zstd -q -c' ;;
+    *)   echo "unknown compression: $compress" >&2; exit 1 ;;
+esac
+
+mkdir -p "$pool"
+stage=$(mktemp -d)
+trap 'rm -rf "$stage"' EXIT
+
+# a fixed timestamp keeps the generated pool byte for byte reproducible
+builddate=1400000000
+
+i=$offset
+while [ "$i" -lt $((offset + count)) ]; do
+    name=$(printf 'bench-pkg-%06d' "$i")
+
+    v=1
+    while [ "$v" -le "$versions" ]; do
+        filename="$name-1.$v-1-x86_64.pkg.tar.$compress"
+
+        rm -rf "$stage"/* "$stage"/.PKGINFO
+        mkdir -p "$stage/usr/share/$name" "$stage/usr/lib/$name"
+
+        cat > "$stage/.PKGINFO" <<PKGINFO
+# Generated by repose bench/genpool.sh
+pkgname = $name
+pkgbase = $name
+pkgver = 1.$v-1
+pkgdesc = Synthetic package $i for benchmarking repose
+url = https://example.org/$name
+builddate = $((builddate + v))
+packager = Repose Benchmark <bench@example.org>
+size = $((files * 4096))
+arch = x86_64
+license = GPL
+group = bench
+depend = glibc
+depend = bench-pkg-$(printf '%06d' $(( (i + 1) % (offset + count) )))
+provides = bench-virtual-$i
+optdepend = bench-extra: for extra things
+makedepend = gcc
+PKGINFO
+
+        f=0
+        while [ "$f" -lt "$files" ]; do
+            if [ $((f % 2)) -eq 0 ]; then
+                : > "$stage/usr/share/$name/data-$f"
+            else
+                : > "$stage/usr/lib/$name/lib$f.so"
+            fi
+            f=$((f + 1))
+        done
+
+        # .PKGINFO first, like makepkg does
+        (cd "$stage" && tar --format=gnu --sort=name --owner=0 --group=0 --numeric-owner \
+            --mtime="@$builddate" -cf - .PKGINFO usr) | $compressor > "$pool/$filename"
+
+        # the signatures are only ever looked at as opaque blobs, so
+        # any bytes will do, but derive them from the filename so they
+        # stay as reproducible as the packages they sit beside
+        if [ "$sign" -eq 1 ]; then
+            head -c 566 /dev/zero | openssl enc -aes-128-ctr -nosalt -pbkdf2 \
+                -pass "pass:$filename" > "$pool/$filename.sig"
+        fi
+
+        v=$((v + 1))
+    done
+
+    i=$((i + 1))
+done
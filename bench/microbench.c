@@ -0,0 +1,529 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+/* Micro-benchmarks for the hot paths underneath repose: the package hash
+ * table, the archive line reader, the desc and .PKGINFO parsers, buffer
+ * formatting, base64 encoding, version comparison and file lists.
+ *
+ * The version comparison benchmark doubles as a differential check of
+ * version_cmp() against alpm_pkg_vercmp(), and fails loudly if they ever
+ * disagree. Likewise, file lists have to write back out byte for byte. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <err.h>
+#include <archive.h>
+#include <archive_entry.h>
+#include <alpm.h>
+
+#include "pkghash.h"
+#include "package.h"
+#include "reader.h"
+#include "desc.h"
+#include "strbuf.h"
+#include "base64.h"
+#include "util.h"
+#include "vercmp.h"
+#include "filelist.h"
+
+struct result {
+    const char *name;
+    size_t ops;
+    uint64_t ns;
+    size_t bytes;
+};
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report(const struct result *r)
+{
+    printf("%-32s %10zu %12.1f", r->name, r->ops, (double)r->ns / r->ops);
+    if (r->bytes)
+        printf(" %12.1f\n", r->bytes / 1048576.0 / (r->ns / 1e9));
+    else
+        printf(" %12s\n", "-");
+}
+
+/* a raw, uncompressed archive over a block of memory, which is exactly
+ * what the desc and .PKGINFO readers see after decompression */
+static struct archive *open_raw(const char *data, size_t len)
+{
+    struct archive *a = archive_read_new();
+    struct archive_entry *entry;
+
+    archive_read_support_filter_none(a);
+    archive_read_support_format_raw(a);
+
+    if (archive_read_open_memory(a, data, len) != ARCHIVE_OK ||
+        archive_read_next_header(a, &entry) != ARCHIVE_OK)
+        errx(EXIT_FAILURE, "failed to open memory archive: %s", archive_error_string(a));
+
+    return a;
+}
+
+static void close_raw(struct archive *a)
+{
+    archive_read_close(a);
+    archive_read_free(a);
+}
+
+static void bench_pkghash(size_t count)
+{
+    struct pkg *pkgs = calloc(count, sizeof(struct pkg));
+    char name[64];
+    size_t i;
+
+    if (!pkgs)
+        err(EXIT_FAILURE, "failed to allocate %zu packages", count);
+
+    for (i = 0; i < count; ++i) {
+        snprintf(name, sizeof(name), "bench-pkg-%zu", i);
+        pkgs[i].name = strdup(name);
+        pkgs[i].name_hash = _alpm_hash_sdbm(pkgs[i].name);
+    }
+
+    alpm_pkghash_t *hash = _alpm_pkghash_create(count);
+    uint64_t start = now();
+    for (i = 0; i < count; ++i)
+        hash = _alpm_pkghash_add(hash, &pkgs[i]);
+    uint64_t add = now() - start;
+
+    start = now();
+    for (i = 0; i < count; ++i) {
+        if (_alpm_pkghash_find(hash, pkgs[i].name) != &pkgs[i])
+            errx(EXIT_FAILURE, "pkghash lost %s", pkgs[i].name);
+    }
+    uint64_t find = now() - start;
+
+    start = now();
+    for (i = 0; i < count; ++i)
+        hash = _alpm_pkghash_remove(hash, &pkgs[i], NULL);
+    uint64_t remove = now() - start;
+
+    char buf[3][64];
+    snprintf(buf[0], sizeof(buf[0]), "pkghash_add/%zu", count);
+    snprintf(buf[1], sizeof(buf[1]), "pkghash_find/%zu", count);
+    snprintf(buf[2], sizeof(buf[2]), "pkghash_remove/%zu", count);
+    report(&(struct result){ buf[0], count, add, 0 });
+    report(&(struct result){ buf[1], count, find, 0 });
+    report(&(struct result){ buf[2], count, remove, 0 });
+
+    _alpm_pkghash_free(hash);
+    for (i = 0; i < count; ++i)
+        free(pkgs[i].name);
+    free(pkgs);
+}
+
+static char *make_lines(size_t size, size_t *len)
+{
+    static const char line[] = "usr/share/locale/de/LC_MESSAGES/bench-package.mo\n";
+    char *data = malloc(size), *p = data;
+
+    while ((size_t)(p - data) + sizeof(line) - 1 <= size)
+        p = mempcpy(p, line, sizeof(line) - 1);
+
+    *len = p - data;
+    return data;
+}
+
+static void bench_reader(void)
+{
+    size_t len, lines = 0;
+    char *data = make_lines(64 << 20, &len);
+    char buf[8192];
+
+    struct archive *a = open_raw(data, len);
+    struct archive_reader *reader = archive_reader_new(a);
+    char *line;
+
+    uint64_t start = now();
+    while (archive_getline(reader, &line) > 0) {
+        free(line);
+        ++lines;
+    }
+    report(&(struct result){ "archive_getline", lines, now() - start, len });
+    free(reader);
+    close_raw(a);
+
+    a = open_raw(data, len);
+    reader = archive_reader_new(a);
+    lines = 0;
+
+    start = now();
+    while (archive_fgets(reader, buf, sizeof(buf)) > 0)
+        ++lines;
+    report(&(struct result){ "archive_fgets", lines, now() - start, len });
+    free(reader);
+    close_raw(a);
+
+    free(data);
+}
+
+static const char desc_template[] =
+    "%FILENAME%\nbench-pkg-1.0-1-x86_64.pkg.tar.xz\n\n"
+    "%NAME%\nbench-pkg\n\n"
+    "%BASE%\nbench-pkg\n\n"
+    "%VERSION%\n1.0-1\n\n"
+    "%DESC%\nA synthetic package used to benchmark the desc parser\n\n"
+    "%GROUPS%\nbench\nbase\n\n"
+    "%CSIZE%\n123456\n\n"
+    "%ISIZE%\n654321\n\n"
+    "%MD5SUM%\nd41d8cd98f00b204e9800998ecf8427e\n\n"
+    "%SHA256SUM%\ne3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855\n\n"
+    "%URL%\nhttps://example.org/bench-pkg\n\n"
+    "%LICENSE%\nGPL\n\n"
+    "%ARCH%\nx86_64\n\n"
+    "%BUILDDATE%\n1400000000\n\n"
+    "%PACKAGER%\nRepose Benchmark <bench@example.org>\n\n"
+    "%DEPENDS%\nglibc\nzlib\nopenssl\n\n"
+    "%PROVIDES%\nbench-virtual\n\n"
+    "%OPTDEPENDS%\nbench-extra: for extra things\n\n"
+    "%MAKEDEPENDS%\ngcc\nmake\n\n";
+
+static const char pkginfo_template[] =
+    "# Generated by makepkg\n"
+    "pkgname = bench-pkg\n"
+    "pkgbase = bench-pkg\n"
+    "pkgver = 1.0-1\n"
+    "pkgdesc = A synthetic package used to benchmark the .PKGINFO parser\n"
+    "url = https://example.org/bench-pkg\n"
+    "builddate = 1400000000\n"
+    "packager = Repose Benchmark <bench@example.org>\n"
+    "size = 654321\n"
+    "arch = x86_64\n"
+    "license = GPL\n"
+    "group = bench\n"
+    "group = base\n"
+    "depend = glibc\n"
+    "depend = zlib\n"
+    "depend = openssl\n"
+    "provides = bench-virtual\n"
+    "optdepend = bench-extra: for extra things\n"
+    "makedepend = gcc\n"
+    "makedepend = make\n";
+
+static void bench_desc(size_t iterations)
+{
+    struct dirtable dirs;
+    size_t i;
+    uint64_t elapsed = 0;
+
+    dirtable_init(&dirs);
+
+    for (i = 0; i < iterations; ++i) {
+        struct pkg *pkg = calloc(1, sizeof(struct pkg));
+        pkg->name = strdup("bench-pkg");
+        pkg->version = strdup("1.0-1");
+
+        struct archive *a = open_raw(desc_template, sizeof(desc_template) - 1);
+        uint64_t start = now();
+        read_desc(a, pkg, &dirs);
+        elapsed += now() - start;
+        close_raw(a);
+
+        package_free(pkg);
+    }
+
+    dirtable_free(&dirs);
+    report(&(struct result){ "read_desc", iterations, elapsed,
+                             iterations * (sizeof(desc_template) - 1) });
+}
+
+static void bench_pkginfo(size_t iterations)
+{
+    size_t i;
+    uint64_t elapsed = 0;
+
+    for (i = 0; i < iterations; ++i) {
+        struct pkg *pkg = calloc(1, sizeof(struct pkg));
+
+        struct archive *a = open_raw(pkginfo_template, sizeof(pkginfo_template) - 1);
+        uint64_t start = now();
+        read_pkginfo(a, pkg);
+        elapsed += now() - start;
+        close_raw(a);
+
+        package_free(pkg);
+    }
+
+    report(&(struct result){ "read_pkginfo", iterations, elapsed,
+                             iterations * (sizeof(pkginfo_template) - 1) });
+}
+
+static void bench_buffer_printf(size_t iterations)
+{
+    buffer_t buf;
+    size_t i, bytes = 0;
+
+    buffer_init(&buf, 1024);
+
+    uint64_t start = now();
+    for (i = 0; i < iterations; ++i) {
+        buffer_printf(&buf, "%%%s%%\n%s\n\n", "FILENAME", "bench-pkg-1.0-1-x86_64.pkg.tar.xz");
+        buffer_printf(&buf, "%%%s%%\n%ld\n\n", "CSIZE", (long)i);
+        if (buf.len > 65536) {
+            bytes += buf.len;
+            buffer_clear(&buf);
+        }
+    }
+    bytes += buf.len;
+    report(&(struct result){ "buffer_printf", iterations * 2, now() - start, bytes });
+
+    buffer_free(&buf);
+}
+
+static void bench_buffer_append(size_t iterations)
+{
+    buffer_t buf;
+    size_t i, bytes = 0;
+
+    buffer_init(&buf, 1024);
+
+    uint64_t start = now();
+    for (i = 0; i < iterations; ++i) {
+        buffer_append(&buf, "%FILENAME%\n", 11);
+        buffer_append_str(&buf, "bench-pkg-1.0-1-x86_64.pkg.tar.xz");
+        buffer_append(&buf, "\n\n", 2);
+        buffer_append(&buf, "%CSIZE%\n", 8);
+        buffer_append_long(&buf, (long)i);
+        buffer_append(&buf, "\n\n", 2);
+        if (buf.len > 65536) {
+            bytes += buf.len;
+            buffer_clear(&buf);
+        }
+    }
+    bytes += buf.len;
+    report(&(struct result){ "buffer_append", iterations * 2, now() - start, bytes });
+
+    buffer_free(&buf);
+}
+
+static void bench_base64(size_t size, size_t iterations)
+{
+    unsigned char *src = malloc(size);
+    char name[64];
+    size_t i;
+
+    for (i = 0; i < size; ++i)
+        src[i] = i * 2654435761u >> 24;
+
+    uint64_t start = now();
+    for (i = 0; i < iterations; ++i) {
+        unsigned char *dst = NULL;
+        base64_encode(&dst, src, size);
+        free(dst);
+    }
+
+    snprintf(name, sizeof(name), "base64_encode/%zu", size);
+    report(&(struct result){ name, iterations, now() - start, size * iterations });
+    free(src);
+}
+
+/* rpmvercmp's corner cases: separators of differing lengths, letters
+ * against numbers, leftovers at the end, epochs and missing releases */
+static const char *vercmp_corpus[] = {
+    "1.5.0", "1.5.1", "1.5", "1.5.0-1", "1.5.0-2", "1.5.1-1", "1.5-1",
+    "1.0a", "1.0alpha", "1.0b", "1.0beta", "1.0rc", "1.0", "1.0.a",
+    "1.0.", "1.0..", "1.0.1", "1.0_1", "1.1b", "1.1.b", "1.0-1.1",
+    "1:1.0", "0:1.0", ":1.0", "2.0", "01", "1", "001", "-1", "1.0-",
+    "1a1", "1.a1", "a", "", "1.0.0.", "2:0.1-1", "1.0+git20140101-1",
+    "1.0~rc1-1", "r1234.abcdef-1", "20140101-3", "1.0\xc3\xa9" "1"
+};
+
+static char *random_version(void)
+{
+    static const char alphabet[] = "0001123456789aabzAZ..-_:+~";
+    char buf[24];
+    int i, len;
+
+    /* mostly plausible versions, with a share of junk mixed in */
+    if (rand() % 4) {
+        snprintf(buf, sizeof(buf), "%s%d.%d.%d%s-%d",
+                 rand() % 8 ? "" : "1:", rand() % 10, rand() % 20, rand() % 5,
+                 rand() % 6 ? "" : "rc1", 1 + rand() % 3);
+    } else {
+        len = rand() % 12;
+        for (i = 0; i < len; ++i)
+            buf[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+        buf[len] = '\0';
+    }
+
+    return strdup(buf);
+}
+
+static void check_vercmp(const char *a, const struct version *va,
+                         const char *b, const struct version *vb)
+{
+    int expected = alpm_pkg_vercmp(a, b), got = version_cmp(va, vb);
+
+    if (expected != got)
+        errx(EXIT_FAILURE, "version_cmp(\"%s\", \"%s\") = %d, alpm_pkg_vercmp says %d",
+             a, b, got, expected);
+}
+
+static void bench_vercmp(size_t count, size_t iterations)
+{
+    const size_t ncorpus = sizeof(vercmp_corpus) / sizeof(vercmp_corpus[0]);
+    char **strs = malloc(count * sizeof(char *));
+    struct version *keys = malloc(count * sizeof(struct version));
+    struct version *corpus = malloc(ncorpus * sizeof(struct version));
+    size_t i, j;
+    uint64_t start;
+    volatile int sink = 0;
+
+    srand(1);
+    for (i = 0; i < ncorpus; ++i)
+        version_parse(&corpus[i], vercmp_corpus[i]);
+    for (i = 0; i < count; ++i) {
+        strs[i] = random_version();
+        version_parse(&keys[i], strs[i]);
+    }
+
+    for (i = 0; i < ncorpus; ++i)
+        for (j = 0; j < ncorpus; ++j)
+            check_vercmp(vercmp_corpus[i], &corpus[i], vercmp_corpus[j], &corpus[j]);
+    for (i = 0; i + 1 < count; ++i)
+        check_vercmp(strs[i], &keys[i], strs[i + 1], &keys[i + 1]);
+
+    start = now();
+    for (j = 0; j < iterations; ++j)
+        for (i = 0; i + 1 < count; ++i)
+            sink += alpm_pkg_vercmp(strs[i], strs[i + 1]);
+    report(&(struct result){ "alpm_pkg_vercmp", iterations * (count - 1), now() - start, 0 });
+
+    start = now();
+    for (j = 0; j < iterations; ++j)
+        for (i = 0; i + 1 < count; ++i)
+            sink += version_cmp(&keys[i], &keys[i + 1]);
+    report(&(struct result){ "version_cmp", iterations * (count - 1), now() - start, 0 });
+
+    for (i = 0; i < ncorpus; ++i)
+        version_free(&corpus[i]);
+    for (i = 0; i < count; ++i) {
+        version_free(&keys[i]);
+        free(strs[i]);
+    }
+    free(corpus);
+    free(keys);
+    free(strs);
+    (void)sink;
+}
+
+/* a package's worth of paths in the shape of a real one: a few deep
+ * directories, each holding many files */
+static size_t make_file_list(buffer_t *buf, size_t pkg)
+{
+    static const char *dirs[] = {
+        "usr/", "usr/bin/", "usr/lib/", "usr/include/bench/",
+        "usr/share/locale/de/LC_MESSAGES/", "usr/share/man/man1/"
+    };
+    size_t i, j, count = 0;
+
+    for (i = 0; i < sizeof(dirs) / sizeof(dirs[0]); ++i) {
+        buffer_printf(buf, "%s\n", dirs[i]);
+        ++count;
+
+        for (j = 0; j < 8 + pkg % 16; ++j, ++count)
+            buffer_printf(buf, "%sb%zu-%zu\n", dirs[i], pkg, j);
+    }
+
+    return count;
+}
+
+static void bench_filelist(size_t count)
+{
+    struct filelist *lists = calloc(count, sizeof(struct filelist));
+    struct dirtable dirs;
+    buffer_t in, out;
+    size_t i, paths = 0, bytes = 0, strdup_bytes = 0, list_bytes = 0;
+    uint64_t start, elapsed = 0;
+
+    dirtable_init(&dirs);
+    buffer_init(&in, 4096);
+    buffer_init(&out, 4096);
+
+    for (i = 0; i < count; ++i) {
+        char *line, *end;
+
+        buffer_clear(&in);
+        paths += make_file_list(&in, i);
+        bytes += in.len;
+
+        start = now();
+        for (line = in.data; line < &in.data[in.len]; line = end + 1) {
+            end = strchr(line, '\n');
+            filelist_add(&lists[i], &dirs, line, end - line);
+
+            /* what a strdup()ed path on an alpm_list_t node costs,
+             * counting a typical 16 bytes of malloc overhead each */
+            strdup_bytes += (end - line + 1) + sizeof(alpm_list_t) + 2 * 16;
+        }
+        elapsed += now() - start;
+        filelist_compact(&lists[i]);
+
+        buffer_clear(&out);
+        filelist_write(&lists[i], &out);
+        if (out.len != in.len || memcmp(out.data, in.data, in.len) != 0)
+            errx(EXIT_FAILURE, "file list %zu didn't write back out as it went in", i);
+
+        list_bytes += filelist_memory(&lists[i]);
+    }
+
+    report(&(struct result){ "filelist_add", paths, elapsed, bytes });
+    printf("%-32s %10zu bytes against %zu as strdup()ed paths\n",
+           "filelist memory", list_bytes, strdup_bytes);
+
+    for (i = 0; i < count; ++i)
+        filelist_free(&lists[i]);
+    free(lists);
+    dirtable_free(&dirs);
+    buffer_free(&in);
+    buffer_free(&out);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t max = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    size_t count;
+
+    printf("%-32s %10s %12s %12s\n", "benchmark", "ops", "ns/op", "MB/s");
+
+    for (count = 1000; count <= max; count *= 10)
+        bench_pkghash(count);
+
+    bench_reader();
+    bench_desc(100000);
+    bench_pkginfo(100000);
+    bench_buffer_printf(1000000);
+    bench_buffer_append(1000000);
+    bench_vercmp(100000, 10);
+    bench_filelist(10000);
+
+    /* a typical detached signature, and something much bigger */
+    bench_base64(566, 100000);
+    bench_base64(1 << 20, 100);
+
+    return 0;
+}
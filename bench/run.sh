@@ -0,0 +1,126 @@
+#!/bin/sh
+#
+# Time repose end to end against a synthetic pool and emit the results
+# as JSON. Each scenario also records repose's own --stats=json
+# breakdown so regressions can be traced to a phase.
+
+set -e
+
+usage() {
+    cat <<USAGE
+usage: ${0##*/} [options]
+Options
+ -r REPOSE      repose binary to benchmark (default: ./repose)
+ -n COUNT       number of distinct packages (default: 1000)
+ -v VERSIONS    versions of each package (default: 1)
+ -f FILES       files in each package (default: 20)
+ -c COMPRESS    package compression: gz, xz or zst (default: xz)
+ -s             give every package a signature
+ -d DIR         keep the generated pool in DIR instead of a temp dir
+ -o FILE        write the JSON results to FILE (default: stdout)
+USAGE
+    exit "${1:-1}"
+}
+
+benchdir=$(cd "$(dirname "$0")" && pwd)
+repose=./repose
+count=1000
+versions=1
+files=20
+compress=xz
+sign=
+workdir=
+output=
+
+while getopts 'r:n:v:f:c:sd:o:h' opt; do
+    case $opt in
+        r) repose=$OPTARG ;;
+        n) count=$OPTARG ;;
+        v) versions=$OPTARG ;;
+        f) files=$OPTARG ;;
+        c) compress=$OPTARG ;;
+        s) sign=-s ;;
+        d) workdir=$OPTARG ;;
+        o) output=$OPTARG ;;
+        h) usage 0 ;;
+        *) usage ;;
+    esac
+done
+
+repose=$(cd "$(dirname "$repose")" && pwd)/${repose##*/}
+[ -x "$repose" ] || { echo "no repose binary at $repose" >&2; exit 1; }
+
+if [ -z "$workdir" ]; then
+    workdir=$(mktemp -d)
+    trap 'rm -rf "$workdir"' EXIT
+fi
+
+pool=$workdir/pool
+mkdir -p "$pool"
+
+if [ -z "$(ls "$pool")" ]; then
+    echo "generating $count packages..." >&2
+    "$benchdir/genpool.sh" -n "$count" -v "$versions" -f "$files" -c "$compress" $sign "$pool"
+fi
+
+now() {
+    date +%s%N
+}
+
+# drop the page cache if we're allowed to, so cold really means cold
+drop_caches() {
+    sync
+    if [ -w /proc/sys/vm/drop_caches ]; then
+        echo 3 > /proc/sys/vm/drop_caches
+        cold=true
+    else
+        cold=false
+    fi
+}
+
+results=
+scenario() {
+    name=$1
+    shift
+
+    start=$(now)
+    if ! "$repose" -r "$pool" -m x86_64 -z --stats=json "$@" 2>"$workdir/stats" >/dev/null; then
+        echo "repose failed in scenario $name:" >&2
+        cat "$workdir/stats" >&2
+        exit 1
+    fi
+    end=$(now)
+    stats=$(tail -n 1 "$workdir/stats")
+
+    results="$results${results:+,}
+    \"$name\": { \"seconds\": $(awk "BEGIN { printf \"%.6f\", ($end - $start) / 1e9 }"), \"stats\": $stats }"
+}
+
+drop_caches
+scenario cold_rebuild --rebuild bench
+scenario noop_update bench
+
+"$benchdir/genpool.sh" -n 1 -o "$count" -f "$files" -c "$compress" $sign "$pool"
+scenario single_add bench
+
+scenario files_build -f bench
+
+scenario mass_drop -d bench 'bench-pkg-0000*'
+
+json="{
+  \"repose\": \"$("$repose" -V | cut -d' ' -f2)\",
+  \"packages\": $count,
+  \"versions\": $versions,
+  \"files\": $files,
+  \"compression\": \"$compress\",
+  \"signed\": $([ -n "$sign" ] && echo true || echo false),
+  \"cold_cache\": $cold,
+  \"scenarios\": {$results
+  }
+}"
+
+if [ -n "$output" ]; then
+    printf '%s\n' "$json" > "$output"
+else
+    printf '%s\n' "$json"
+fi
@@ -18,6 +18,7 @@
 #include "database.h"
 
 #include <stdlib.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -28,16 +29,28 @@
 #include <fcntl.h>
 #include <err.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
 
 #include "file.h"
+#include "decompress.h"
+#include "filecache.h"
 #include "pkghash.h"
 #include "util.h"
 #include "desc.h"
 #include "strbuf.h"
+#include "stats.h"
+#include "tar.h"
+#include "vercmp.h"
+#include "index.h"
 #include <alpm.h>
 
 struct db {
     int fd;
+    int spoolfd;
+    struct arena *arena;
+    struct dirtable *dirs;
     struct file_t file;
     struct archive *archive;
     int filter;
@@ -51,9 +64,19 @@ struct db_entry {
     const char *version;
 };
 
-static int open_db(struct db *db, int fd)
+static int open_db(struct db *db, int fd, int spoolfd, struct arena *arena,
+                   struct dirtable *dirs)
 {
-    *db = (struct db){ .filter  = ARCHIVE_COMPRESSION_NONE };
+    const void *data;
+    ssize_t len;
+    enum decompressor kind;
+
+    *db = (struct db){
+        .filter  = ARCHIVE_COMPRESSION_NONE,
+        .spoolfd = spoolfd,
+        .arena   = arena,
+        .dirs    = dirs
+    };
 
     if (file_from_fd(&db->file, fd) < 0)
         return -1;
@@ -65,15 +88,40 @@ static int open_db(struct db *db, int fd)
     archive_read_support_filter_all(db->archive);
     archive_read_support_format_all(db->archive);
 
-    if (archive_read_open_memory(db->archive, db->file.mmap, db->file.st.st_size) != ARCHIVE_OK) {
+    /* the whole database is already in memory, so if we have a single
+     * shot decoder for it, unpack it in one go rather than streaming it
+     * through libarchive's filters */
+    len = decompress_memory(arena, db->file.mmap, db->file.st.st_size, &kind);
+    if (len >= 0) {
+        data = arena->data;
+        db->filter = kind == DECOMPRESS_GZIP ? ARCHIVE_FILTER_GZIP : ARCHIVE_FILTER_ZSTD;
+        file_unmap(&db->file);
+        db->file.mmap = MAP_FAILED;
+    } else {
+        data = db->file.mmap;
+        len = db->file.st.st_size;
+    }
+
+    if (archive_read_open_memory(db->archive, data, len) != ARCHIVE_OK) {
         archive_read_free(db->archive);
+        file_unmap(&db->file);
+        arena_reset(arena);
         return -1;
     }
 
-    db->filter = archive_filter_code(db->archive, 0);
+    if (db->filter == ARCHIVE_COMPRESSION_NONE)
+        db->filter = archive_filter_code(db->archive, 0);
     return 0;
 }
 
+static void close_db(struct db *db)
+{
+    archive_read_close(db->archive);
+    archive_read_free(db->archive);
+    file_unmap(&db->file);
+    arena_reset(db->arena);
+}
+
 static int parse_db_entry(const char *entryname, struct db_entry *entry)
 {
     entry->name = strdup(entryname);
@@ -124,6 +172,11 @@ static struct pkg *load_pkg_for_entry(struct db *db, alpm_pkghash_t **pkgcache,
             .mtime     = db->mtime
         };
 
+        if (version_parse(&pkg->version_key, pkg->version) < 0) {
+            package_free(pkg);
+            return NULL;
+        }
+
         *pkgcache = _alpm_pkghash_add_sorted(*pkgcache, pkg);
     }
 
@@ -131,6 +184,47 @@ static struct pkg *load_pkg_for_entry(struct db *db, alpm_pkghash_t **pkgcache,
     return pkg;
 }
 
+/* Rather than keep every file list from the old database in memory for
+ * the rest of the run, copy the entry verbatim to the spool. It's copied
+ * back out, unparsed, when the database is written again. */
+static int spool_files(struct db *db, struct pkg *pkg)
+{
+    off_t offset = lseek(db->spoolfd, 0, SEEK_END);
+    size_t total = 0;
+    const void *block;
+    size_t size;
+    int64_t block_offset;
+    int ret;
+
+    if (offset < 0)
+        return -1;
+
+    while ((ret = archive_read_data_block(db->archive, &block, &size, &block_offset)) == ARCHIVE_OK) {
+        const char *data = block;
+
+        while (size) {
+            ssize_t nbytes_w = write(db->spoolfd, data, size);
+            if (nbytes_w < 0)
+                return -1;
+
+            data += nbytes_w;
+            size -= nbytes_w;
+            total += nbytes_w;
+        }
+    }
+
+    /* a truncated or corrupt entry would otherwise be carried over
+     * into the next database as if it were whole */
+    if (ret != ARCHIVE_EOF) {
+        errno = EIO;
+        return -1;
+    }
+
+    pkg->files_offset = offset;
+    pkg->files_size = total;
+    return 0;
+}
+
 static int db_read_pkg(struct db *db, alpm_pkghash_t **pkgcache,
                         struct archive_entry *entry)
 {
@@ -149,181 +243,545 @@ static int db_read_pkg(struct db *db, alpm_pkghash_t **pkgcache,
             return -1;
         }
 
-        if (streq(e.type, "desc") || streq(e.type, "depends") || streq(e.type, "files"))
-            read_desc(db->archive, pkg);
+        int ret = 0;
+        if (streq(e.type, "files") && db->spoolfd >= 0) {
+            ret = spool_files(db, pkg);
+            if (ret < 0)
+                warn("failed to spool file list for %s", pkg->name);
+        } else if (streq(e.type, "desc") || streq(e.type, "depends") || streq(e.type, "files")) {
+            ret = read_desc(db->archive, pkg, db->dirs);
+        }
+
+        if (ret < 0) {
+            free_db_entry(&e);
+            return -1;
+        }
     }
 
     free_db_entry(&e);
     return 0;
 }
 
-int load_database(int fd, alpm_pkghash_t **pkgcache)
+int load_database(int fd, alpm_pkghash_t **pkgcache, int spoolfd, struct arena *arena,
+                  struct dirtable *dirs)
 {
     struct db db;
     struct archive_entry *entry;
 
-    if (open_db(&db, fd) < 0)
+    if (open_db(&db, fd, spoolfd, arena, dirs) < 0)
         return -1;
 
     while (archive_read_next_header(db.archive, &entry) == ARCHIVE_OK) {
         const mode_t mode = archive_entry_mode(entry);
 
-        if (S_ISREG(mode) && db_read_pkg(&db, pkgcache, entry) < 0)
+        if (S_ISREG(mode) && db_read_pkg(&db, pkgcache, entry) < 0) {
+            close_db(&db);
             return -1;
+        }
     }
 
-    archive_read_close(db.archive);
-    archive_read_free(db.archive);
+    close_db(&db);
 
     return 0;
 }
 
-static void write_list(buffer_t *buf, const char *header, const alpm_list_t *lst)
+/* expands to a section header, e.g. "%NAME%\n", followed by its length */
+#define SECTION(name) "%" name "%\n", sizeof("%" name "%\n") - 1
+
+static void write_list(buffer_t *buf, const char *header, size_t header_len,
+                       const alpm_list_t *lst)
 {
     if (lst == NULL)
         return;
 
-    buffer_printf(buf, "%%%s%%\n", header);
-    for (; lst; lst = lst->next)
-        buffer_printf(buf, "%s\n", (const char *)lst->data);
+    buffer_append(buf, header, header_len);
+    for (; lst; lst = lst->next) {
+        buffer_append_str(buf, lst->data);
+        buffer_putc(buf, '\n');
+    }
     buffer_putc(buf, '\n');
 }
 
-static void write_string(buffer_t *buf, const char *header, const char *str)
+static int write_files(buffer_t *buf, const char *header, size_t header_len,
+                       const struct filelist *files)
+{
+    if (files->count == 0)
+        return 0;
+
+    if (buffer_append(buf, header, header_len) < 0 ||
+        filelist_write(files, buf) < 0 ||
+        buffer_putc(buf, '\n') < 0)
+        return -1;
+    return 0;
+}
+
+static void write_string(buffer_t *buf, const char *header, size_t header_len,
+                         const char *str)
 {
     if (str == NULL)
         return;
 
-    buffer_printf(buf, "%%%s%%\n%s\n\n", header, str);
+    buffer_append(buf, header, header_len);
+    buffer_append_str(buf, str);
+    buffer_append(buf, "\n\n", 2);
 }
 
-static void write_long(buffer_t *buf, const char *header, long val)
+static void write_long(buffer_t *buf, const char *header, size_t header_len, long val)
 {
-    buffer_printf(buf, "%%%s%%\n%ld\n\n", header, val);
+    buffer_append(buf, header, header_len);
+    buffer_append_long(buf, val);
+    buffer_append(buf, "\n\n", 2);
 }
 
 static void compile_depends_entry(struct pkg *pkg, buffer_t *buf)
 {
-    write_list(buf, "DEPENDS",      pkg->depends);
-    write_list(buf, "CONFLICTS",    pkg->conflicts);
-    write_list(buf, "PROVIDES",     pkg->provides);
-    write_list(buf, "OPTDEPENDS",   pkg->optdepends);
-    write_list(buf, "MAKEDEPENDS",  pkg->makedepends);
-    write_list(buf, "CHECKDEPENDS", pkg->checkdepends);
+    write_list(buf, SECTION("DEPENDS"),      pkg->depends);
+    write_list(buf, SECTION("CONFLICTS"),    pkg->conflicts);
+    write_list(buf, SECTION("PROVIDES"),     pkg->provides);
+    write_list(buf, SECTION("OPTDEPENDS"),   pkg->optdepends);
+    write_list(buf, SECTION("MAKEDEPENDS"),  pkg->makedepends);
+    write_list(buf, SECTION("CHECKDEPENDS"), pkg->checkdepends);
 }
 
-static void compile_desc_entry(struct pkg *pkg, buffer_t *buf, int poolfd)
+static void compile_desc_entry(struct pkg *pkg, buffer_t *buf)
 {
-    write_string(buf, "FILENAME",  pkg->filename);
-    write_string(buf, "NAME",      pkg->name);
-    write_string(buf, "BASE",      pkg->base);
-    write_string(buf, "VERSION",   pkg->version);
-    write_string(buf, "DESC",      pkg->desc);
-    write_list(buf,   "GROUPS",    pkg->groups);
-    write_long(buf,   "CSIZE",     (long)pkg->size);
-    write_long(buf,   "ISIZE",     (long)pkg->isize);
-
-    if (!pkg->md5sum)
-        pkg->md5sum = md5_file(poolfd, pkg->filename);
-    if (!pkg->sha256sum)
-        pkg->sha256sum = sha256_file(poolfd, pkg->filename);
-    if (!pkg->base64sig)
-        load_package_signature(pkg, poolfd);
-
-    write_string(buf, "MD5SUM", pkg->md5sum);
-    write_string(buf, "SHA256SUM", pkg->sha256sum);
+    write_string(buf, SECTION("FILENAME"),  pkg->filename);
+    write_string(buf, SECTION("NAME"),      pkg->name);
+    write_string(buf, SECTION("BASE"),      pkg->base);
+    write_string(buf, SECTION("VERSION"),   pkg->version);
+    write_string(buf, SECTION("DESC"),      pkg->desc);
+    write_list(buf,   SECTION("GROUPS"),    pkg->groups);
+    write_long(buf,   SECTION("CSIZE"),     (long)pkg->size);
+    write_long(buf,   SECTION("ISIZE"),     (long)pkg->isize);
+
+    /* packages only found in the database can't be looked at */
+    if (pkg->pool) {
+        stats_count(pkg->base64sig ? COUNTER_SIGNATURE_HIT : COUNTER_SIGNATURE_MISS);
+        stats_begin(PHASE_SIGNATURES);
+        if (!pkg->base64sig)
+            load_package_signature(pkg, pkg->pool->fd);
+        stats_end(PHASE_SIGNATURES);
+
+        stats_count(pkg->md5sum && pkg->sha256sum ? COUNTER_CHECKSUM_HIT : COUNTER_CHECKSUM_MISS);
+        if (!pkg->md5sum || !pkg->sha256sum) {
+            stats_begin(PHASE_HASH);
+            if (package_digest(pkg, pkg->pool->fd, NULL) < 0)
+                warn("failed to read %s", pkg->path);
+            stats_end(PHASE_HASH);
+        }
+    }
+
+    write_string(buf, SECTION("MD5SUM"), pkg->md5sum);
+    write_string(buf, SECTION("SHA256SUM"), pkg->sha256sum);
 
     if (pkg->base64sig)
-        write_string(buf, "PGPSIG", pkg->base64sig);
-
-    write_string(buf, "URL",       pkg->url);
-    write_list(buf,   "LICENSE",   pkg->licenses);
-    write_string(buf, "ARCH",      pkg->arch);
-    write_long(buf,   "BUILDDATE", pkg->builddate);
-    write_string(buf, "PACKAGER",  pkg->packager);
-    write_list(buf,   "REPLACES",  pkg->replaces);
+        write_string(buf, SECTION("PGPSIG"), pkg->base64sig);
+
+    write_string(buf, SECTION("URL"),       pkg->url);
+    write_list(buf,   SECTION("LICENSE"),   pkg->licenses);
+    write_string(buf, SECTION("ARCH"),      pkg->arch);
+    write_long(buf,   SECTION("BUILDDATE"), pkg->builddate);
+    write_string(buf, SECTION("PACKAGER"),  pkg->packager);
+    write_list(buf,   SECTION("REPLACES"),  pkg->replaces);
 }
 
-static void compile_files_entry(struct pkg *pkg, buffer_t *buf, int poolfd)
+static int unspool_files(const struct pkg *pkg, buffer_t *buf, int spoolfd)
+{
+    size_t done = 0;
+
+    if (buffer_reserve(buf, pkg->files_size) < 0)
+        return -1;
+
+    while (done < pkg->files_size) {
+        ssize_t nbytes_r = pread(spoolfd, &buf->data[buf->len + done],
+                                 pkg->files_size - done, pkg->files_offset + done);
+        if (nbytes_r < 0)
+            return -1;
+        if (nbytes_r == 0) {
+            errno = EIO;
+            return -1;
+        }
+        done += nbytes_r;
+    }
+
+    buf->len += done;
+    buf->data[buf->len] = '\0';
+    return 0;
+}
+
+static int compile_files_entry(struct pkg *pkg, buffer_t *buf,
+                               const struct db_options *options)
+{
+    if (pkg->files_size) {
+        stats_count(COUNTER_FILES_HIT);
+        if (unspool_files(pkg, buf, options->spoolfd) < 0) {
+            warn("failed to read back file list for %s", pkg->name);
+            return -1;
+        }
+        return 0;
+    }
+
+    stats_count(pkg->files.count ? COUNTER_FILES_HIT : COUNTER_FILES_MISS);
+    if (!pkg->files.count && pkg->pool) {
+        _cleanup_close_ int pkgfd = openat(pkg->pool->fd, pkg->path, O_RDONLY);
+        if (pkgfd < 0 && errno != ENOENT) {
+            warn("failed to open %s", pkg->path);
+            return -1;
+        }
+
+        if (pkgfd >= 0 && load_package_files(pkg, pkgfd, options->dirs) < 0) {
+            warn("failed to read the file list of %s", pkg->path);
+            return -1;
+        }
+    }
+
+    int ret = write_files(buf, SECTION("FILES"), &pkg->files);
+    if (ret < 0)
+        warn("failed to write the file list of %s", pkg->name);
+
+    /* don't let the lists pile up between writes when they can be read
+     * from the package again; a package only known from the database
+     * has nowhere else to get its list from */
+    if (pkg->pool)
+        filelist_free(&pkg->files);
+    return ret;
+}
+
+/* Each output archive gets its own thread to compress on, fed by the
+ * main thread through a small ring of records. The records' buffers are
+ * reused, so the steady state doesn't allocate. */
+#define QUEUE_DEPTH 64
+
+/* hand back any record buffer that grew past this, so a run of large
+ * file lists doesn't stay resident for the rest of the write */
+#define RECORD_RETAIN (1 << 20)
+
+/* Every record's buffer starts with a block reserved for its tar header.
+ * When all the paths fit in plain ustar headers, the writer fills it in
+ * and pushes header, data and padding through libarchive's raw format as
+ * one write. Otherwise the block is skipped and libarchive's pax writer
+ * produces the headers instead. */
+static const char zero_block[TAR_BLOCK];
+
+struct record {
+    char *path;
+    time_t mtime;
+    struct buffer buf;
+};
+
+struct writer {
+    struct archive *archive;
+    struct archive_entry *entry;
+    enum contents what;
+    bool raw;
+    size_t written;
+
+    pthread_t thread;
+    struct stats *stats;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct record records[QUEUE_DEPTH];
+    size_t head, tail;
+    bool done;
+    /* once set, the writer thread only drains the queue */
+    atomic_bool failed;
+};
+
+static void record_raw(struct writer *w, struct record *record)
 {
-    if (!pkg->files) {
-        _cleanup_close_ int pkgfd = openat(poolfd, pkg->filename, O_RDONLY);
-        if (pkgfd < 0 && errno != ENOENT)
-            err(EXIT_FAILURE, "failed to open %s", pkg->filename);
+    size_t size = record->buf.len - TAR_BLOCK;
 
-        load_package_files(pkg, pkgfd);
+    if (tar_header(record->buf.data, record->path, size, record->mtime) < 0) {
+        warnx("failed to write a tar header for %s", record->path);
+        w->failed = true;
+        return;
     }
 
-    write_list(buf, "FILES", pkg->files);
+    buffer_append(&record->buf, zero_block, tar_padding(size));
+    archive_write_data(w->archive, record->buf.data, record->buf.len);
+    w->written += record->buf.len;
+}
+
+/* two zero blocks mark the end of the archive, and like tar, pad the
+ * whole thing out to a full record */
+static void finish_raw(struct writer *w)
+{
+    size_t trailer = 2 * TAR_BLOCK;
+
+    trailer += (TAR_RECORD - (w->written + trailer) % TAR_RECORD) % TAR_RECORD;
+    for (; trailer; trailer -= TAR_BLOCK)
+        archive_write_data(w->archive, zero_block, TAR_BLOCK);
 }
 
 static void record_entry(struct archive *archive, struct archive_entry *e,
-                         const char *root, const char *entry, struct buffer *buf)
+                         const struct record *record)
 {
-    _cleanup_free_ char *entry_path = joinstring(root, "/", entry, NULL);
-    time_t now = time(NULL);
+    size_t size = record->buf.len - TAR_BLOCK;
 
-    archive_entry_set_pathname(e, entry_path);
+    archive_entry_set_pathname(e, record->path);
     archive_entry_set_filetype(e, AE_IFREG);
-    archive_entry_set_size(e, buf->len);
+    archive_entry_set_size(e, size);
 
     archive_entry_set_perm(e, 0644);
-    archive_entry_set_ctime(e, now, 0);
-    archive_entry_set_mtime(e, now, 0);
-    archive_entry_set_atime(e, now, 0);
+    archive_entry_set_mtime(e, record->mtime, 0);
 
     archive_write_header(archive, e);
-    archive_write_data(archive, buf->data, buf->len);
+    archive_write_data(archive, &record->buf.data[TAR_BLOCK], size);
 
     archive_entry_clear(e);
-    buffer_clear(buf);
 }
 
+static void *writer_thread(void *arg)
+{
+    struct writer *w = arg;
+    struct stats_timer timer;
+
+    stats_attach(w->stats);
+    stats_timer_start(&timer);
+
+    for (;;) {
+        struct record *record;
+
+        pthread_mutex_lock(&w->lock);
+        while (w->head == w->tail && !w->done)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (w->head == w->tail) {
+            pthread_mutex_unlock(&w->lock);
+            break;
+        }
+        record = &w->records[w->tail % QUEUE_DEPTH];
+        pthread_mutex_unlock(&w->lock);
+
+        if (!w->failed) {
+            if (w->raw)
+                record_raw(w, record);
+            else
+                record_entry(w->archive, w->entry, record);
+        }
+        free(record->path);
+
+        if (record->buf.buflen > RECORD_RETAIN) {
+            buffer_free(&record->buf);
+            buffer_init(&record->buf, 1024);
+        }
+
+        pthread_mutex_lock(&w->lock);
+        ++w->tail;
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    if (w->raw && !w->failed)
+        finish_raw(w);
+
+    if (archive_write_close(w->archive) != ARCHIVE_OK)
+        w->failed = true;
+    stats_timer_stop(&timer, PHASE_COMPRESS);
+    return NULL;
+}
+
+static struct record *writer_reserve(struct writer *w)
+{
+    struct record *record;
+
+    pthread_mutex_lock(&w->lock);
+    while (w->head - w->tail == QUEUE_DEPTH)
+        pthread_cond_wait(&w->cond, &w->lock);
+    record = &w->records[w->head % QUEUE_DEPTH];
+    pthread_mutex_unlock(&w->lock);
+
+    buffer_clear(&record->buf);
+    buffer_append(&record->buf, zero_block, TAR_BLOCK);
+    return record;
+}
+
+static void writer_commit(struct writer *w, struct record *record,
+                          const char *root, const char *entry, time_t mtime)
+{
+    record->path = joinstring(root, "/", entry, NULL);
+    record->mtime = mtime;
+
+    pthread_mutex_lock(&w->lock);
+    ++w->head;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void add_filter(struct archive *archive, const struct db_options *options)
+{
+    if (options->compression != ARCHIVE_FILTER_GZIP) {
+        archive_write_add_filter(archive, options->compression);
+        return;
+    }
+
+    /* libarchive's gzip can't be made rsyncable, but gzip itself can;
+     * either way leave the timestamp out of the header */
+    if (options->rsyncable) {
+        archive_write_add_filter_program(archive, "gzip -n --rsyncable");
+    } else {
+        archive_write_add_filter(archive, ARCHIVE_FILTER_GZIP);
+        archive_write_set_filter_option(archive, "gzip", "timestamp", NULL);
+    }
+}
+
+static int writer_start(struct writer *w, const struct db_output *output,
+                        const struct db_options *options, bool raw)
+{
+    size_t i;
+
+    *w = (struct writer){
+        .archive = archive_write_new(),
+        .entry = archive_entry_new(),
+        .what = output->what,
+        .stats = stats_attached()
+    };
+
+    add_filter(w->archive, options);
+    w->raw = raw && archive_write_set_format_raw(w->archive) == ARCHIVE_OK;
+    if (!w->raw)
+        archive_write_set_format_pax_restricted(w->archive);
+
+    if (archive_write_open_fd(w->archive, output->fd) < 0) {
+        archive_entry_free(w->entry);
+        archive_write_free(w->archive);
+        return -1;
+    }
+
+    /* the raw format takes a single entry, which the whole tar stream
+     * is then written into */
+    if (w->raw) {
+        archive_entry_set_filetype(w->entry, AE_IFREG);
+        archive_write_header(w->archive, w->entry);
+        archive_entry_clear(w->entry);
+    }
+
+    for (i = 0; i < QUEUE_DEPTH; ++i)
+        buffer_init(&w->records[i].buf, 1024);
 
-static void compile_database_entry(struct archive *archive, struct archive_entry *e, struct pkg *pkg,
-                                   int contents, struct buffer *buf, int poolfd)
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    pthread_create(&w->thread, NULL, writer_thread, w);
+    return 0;
+}
+
+static int writer_finish(struct writer *w)
+{
+    size_t i;
+
+    pthread_mutex_lock(&w->lock);
+    w->done = true;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_join(w->thread, NULL);
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+
+    for (i = 0; i < QUEUE_DEPTH; ++i)
+        buffer_free(&w->records[i].buf);
+
+    archive_entry_free(w->entry);
+    archive_write_free(w->archive);
+    return w->failed ? -1 : 0;
+}
+
+static int compile_database_entry(struct writer *w, struct pkg *pkg,
+                                  const struct db_options *options)
 {
     _cleanup_free_ char *entry = joinstring(pkg->name, "-", pkg->version, NULL);
+    time_t mtime = options->epoch >= 0 ? options->epoch : pkg->builddate;
+    struct record *record;
 
-    if (contents & DB_DESC) {
-        compile_desc_entry(pkg, buf, poolfd);
-        record_entry(archive, e, entry, "desc", buf);
+    if (w->what & DB_DESC) {
+        record = writer_reserve(w);
+        compile_desc_entry(pkg, &record->buf);
+        writer_commit(w, record, entry, "desc", mtime);
     }
-    if (contents & DB_DEPENDS) {
-        compile_depends_entry(pkg, buf);
-        record_entry(archive, e, entry, "depends", buf);
+    if (w->what & DB_DEPENDS) {
+        record = writer_reserve(w);
+        compile_depends_entry(pkg, &record->buf);
+        writer_commit(w, record, entry, "depends", mtime);
     }
-    if (contents & DB_FILES) {
-        compile_files_entry(pkg, buf, poolfd);
-        record_entry(archive, e, entry, "files", buf);
+    if (w->what & DB_FILES) {
+        record = writer_reserve(w);
+
+        /* a half written record is still handed over, so the ring keeps
+         * moving, but never reaches the archive */
+        int ret = compile_files_entry(pkg, &record->buf, options);
+
+        /* the list is only around as text, and only until it's handed
+         * to the writer */
+        if (ret == 0 && options->index &&
+            index_add_files(options->index, &record->buf.data[TAR_BLOCK],
+                            record->buf.len - TAR_BLOCK) < 0) {
+            warn("failed to index files of %s", pkg->name);
+            ret = -1;
+        }
+
+        if (ret < 0)
+            w->failed = true;
+        writer_commit(w, record, entry, "files", mtime);
+        return ret;
     }
+
+    return 0;
 }
 
-int save_database(int fd, alpm_pkghash_t *pkgcache, enum contents what, int compression, int poolfd)
+/* whether every entry's path fits a plain ustar header; "depends" is the
+ * longest file name written */
+static bool fits_ustar(alpm_pkghash_t *pkgcache)
 {
-    struct archive *archive = archive_write_new();
-    struct archive_entry *entry = archive_entry_new();
-    alpm_list_t *pkg, *pkgs = pkgcache->list;
-    struct buffer buf;
+    alpm_list_t *node;
 
-    archive_write_add_filter(archive, compression);
-    archive_write_set_format_pax_restricted(archive);
+    for (node = pkgcache->list; node; node = node->next) {
+        const struct pkg *pkg = node->data;
+        size_t dirlen = strlen(pkg->name) + 1 + strlen(pkg->version);
 
-    if (archive_write_open_fd(archive, fd) < 0)
-        return -1;
+        if (!tar_fits(dirlen, strlen("depends")))
+            return false;
+    }
 
-    buffer_init(&buf, 1024);
+    return true;
+}
 
-    for (pkg = pkgs; pkg; pkg = pkg->next) {
-        struct pkg *metadata = pkg->data;
-        compile_database_entry(archive, entry, metadata, what, &buf, poolfd);
+int save_database(const struct db_output *outputs, size_t count,
+                  alpm_pkghash_t *pkgcache, const struct db_options *options)
+{
+    struct writer writers[count];
+    alpm_list_t *pkg;
+    size_t i, j;
+    int ret = 0;
+    bool raw = fits_ustar(pkgcache);
+
+    /* packages added from the pool are appended in whatever order they
+     * were found in */
+    _alpm_pkghash_sort(pkgcache);
+
+    for (i = 0; i < count; ++i) {
+        if (writer_start(&writers[i], &outputs[i], options, raw) < 0) {
+            while (i--)
+                writer_finish(&writers[i]);
+            return -1;
+        }
     }
 
-    buffer_free(&buf);
+    for (pkg = pkgcache->list; pkg && ret == 0; pkg = pkg->next) {
+        struct pkg *metadata = pkg->data;
 
-    archive_write_close(archive);
-    archive_entry_free(entry);
-    archive_write_free(archive);
+        if (options->index && index_add_package(options->index, metadata) < 0) {
+            warn("failed to index %s", metadata->name);
+            ret = -1;
+            break;
+        }
 
-    return 0;
+        for (j = 0; j < count && ret == 0; ++j)
+            ret = compile_database_entry(&writers[j], metadata, options);
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (writer_finish(&writers[i]) < 0)
+            ret = -1;
+    }
+
+    return ret;
 }
@@ -17,6 +17,8 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <time.h>
 #include "pkghash.h"
 
 enum contents {
@@ -25,5 +27,36 @@ enum contents {
     DB_FILES   = 1 << 3
 };
 
-int load_database(int fd, alpm_pkghash_t **pkgcache);
-int save_database(int fd, alpm_pkghash_t *pkgcache, enum contents what, int compression, int poolfd);
+struct index_builder;
+struct arena;
+
+struct db_output {
+    int fd;
+    enum contents what;
+};
+
+struct db_options {
+    int compression;
+    bool rsyncable;
+    /* stamp every entry with this, rather than its package's builddate,
+     * when not negative */
+    time_t epoch;
+    int spoolfd;
+    /* file lists read from packages go here */
+    struct dirtable *dirs;
+    /* when set, every package written is also added to this index */
+    struct index_builder *index;
+};
+
+/* With a spoolfd, file lists from a .files database are copied there
+ * raw instead of being parsed, and save_database() copies them back
+ * out. Pass -1 to keep them in memory, in dirs. Compressed databases are
+ * unpacked into arena, which is emptied again before returning but
+ * keeps its mapping for the next load until arena_free(). */
+int load_database(int fd, alpm_pkghash_t **pkgcache, int spoolfd, struct arena *arena,
+                  struct dirtable *dirs);
+
+/* The output is deterministic: entries are written sorted by package
+ * name and stamped from package data, not the clock. */
+int save_database(const struct db_output *outputs, size_t count,
+                  alpm_pkghash_t *pkgcache, const struct db_options *options);
@@ -0,0 +1,194 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#include "decompress.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#if defined(HAVE_LIBDEFLATE) || defined(HAVE_ZSTD)
+static int arena_reserve(struct arena *arena, size_t size)
+{
+    char *data;
+
+    if (size <= arena->size)
+        return 0;
+
+    if (arena->data)
+        data = mremap(arena->data, arena->size, size, MREMAP_MAYMOVE);
+    else
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (data == MAP_FAILED)
+        return -1;
+
+    arena->data = data;
+    arena->size = size;
+    return 0;
+}
+#endif
+
+void arena_reset(struct arena *arena)
+{
+    if (arena->data)
+        madvise(arena->data, arena->size, MADV_DONTNEED);
+}
+
+void arena_free(struct arena *arena)
+{
+    if (arena->data)
+        munmap(arena->data, arena->size);
+    *arena = (struct arena){ 0 };
+}
+
+#ifdef HAVE_LIBDEFLATE
+static ssize_t gunzip(struct arena *arena, const unsigned char *src, size_t len)
+{
+    struct libdeflate_decompressor *d = libdeflate_alloc_decompressor();
+    size_t in_pos = 0, out_pos = 0;
+
+    /* the trailer holds the size of the last member, modulo 4GiB, which
+     * for the single member streams libarchive writes is exact */
+    size_t guess = (uint32_t)src[len - 4] | (uint32_t)src[len - 3] << 8 |
+        (uint32_t)src[len - 2] << 16 | (uint32_t)src[len - 1] << 24;
+
+    if (!d)
+        return -1;
+
+    if (arena_reserve(arena, guess > len ? guess : len * 4) < 0)
+        goto fail;
+
+    while (in_pos < len) {
+        size_t in_used, out_used;
+        enum libdeflate_result r = libdeflate_gzip_decompress_ex(d, &src[in_pos], len - in_pos,
+                                                                 &arena->data[out_pos],
+                                                                 arena->size - out_pos,
+                                                                 &in_used, &out_used);
+
+        if (r == LIBDEFLATE_INSUFFICIENT_SPACE) {
+            if (arena_reserve(arena, arena->size * 2) < 0)
+                goto fail;
+            continue;
+        } else if (r != LIBDEFLATE_SUCCESS) {
+            errno = ENOTSUP;
+            goto fail;
+        }
+
+        in_pos += in_used;
+        out_pos += out_used;
+    }
+
+    libdeflate_free_decompressor(d);
+    return out_pos;
+
+fail:
+    libdeflate_free_decompressor(d);
+    return -1;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static ssize_t unzstd(struct arena *arena, const void *src, size_t len)
+{
+    ZSTD_DStream *stream = ZSTD_createDStream();
+    ZSTD_inBuffer in = { .src = src, .size = len };
+    ZSTD_outBuffer out = { 0 };
+
+    /* libarchive streams its output, so the content size usually isn't
+     * recorded in the frame; guess instead and grow as needed. Only the
+     * first frame is looked at, it's just a hint either way */
+    unsigned long long size = ZSTD_getFrameContentSize(src, len);
+    if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR)
+        size = len * 8;
+
+    if (!stream)
+        return -1;
+
+    if (arena_reserve(arena, size ? size : len) < 0)
+        goto fail;
+
+    ZSTD_initDStream(stream);
+
+    for (;;) {
+        size_t r;
+
+        if (out.pos == arena->size && arena_reserve(arena, arena->size * 2) < 0)
+            goto fail;
+
+        out.dst = arena->data;
+        out.size = arena->size;
+
+        r = ZSTD_decompressStream(stream, &out, &in);
+        if (ZSTD_isError(r)) {
+            errno = ENOTSUP;
+            goto fail;
+        }
+
+        /* room left over means nothing more is buffered in the stream,
+         * and a nonzero hint then means the last frame was cut short */
+        if (in.pos == in.size && out.pos < out.size) {
+            if (r != 0) {
+                errno = ENOTSUP;
+                goto fail;
+            }
+            break;
+        }
+    }
+
+    ZSTD_freeDStream(stream);
+    return out.pos;
+
+fail:
+    ZSTD_freeDStream(stream);
+    return -1;
+}
+#endif
+
+ssize_t decompress_memory(struct arena *arena, const void *src, size_t len,
+                          enum decompressor *kind)
+{
+    *kind = DECOMPRESS_NONE;
+
+#ifdef HAVE_LIBDEFLATE
+    /* header and trailer alone are 18 bytes */
+    if (len >= 18 && memcmp(src, "\x1f\x8b", 2) == 0) {
+        *kind = DECOMPRESS_GZIP;
+        return gunzip(arena, src, len);
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (len >= 4 && memcmp(src, "\x28\xb5\x2f\xfd", 4) == 0) {
+        *kind = DECOMPRESS_ZSTD;
+        return unzstd(arena, src, len);
+    }
+#endif
+
+    (void)arena;
+    (void)src;
+    (void)len;
+    errno = ENOTSUP;
+    return -1;
+}
@@ -0,0 +1,44 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* A growable anonymous mapping. Resetting it hands the pages back to
+ * the kernel but keeps the address space around for the next use. */
+struct arena {
+    char *data;
+    size_t size;
+};
+
+enum decompressor {
+    DECOMPRESS_NONE,
+    DECOMPRESS_GZIP,
+    DECOMPRESS_ZSTD
+};
+
+void arena_reset(struct arena *arena);
+void arena_free(struct arena *arena);
+
+/* Decompress a whole gzip or zstd stream that's already in memory into
+ * the arena in one go. Returns the decompressed length, or -1 with errno
+ * set to ENOTSUP if there's no fast path for the input, in which case
+ * the caller should fall back to libarchive's filters. */
+ssize_t decompress_memory(struct arena *arena, const void *src, size_t len,
+                          enum decompressor *kind);
@@ -0,0 +1,304 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#include "dedup.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "file.h"
+#include "strmap.h"
+#include "util.h"
+
+struct candidate {
+    struct pool_file *file;
+    size_t order;
+    off_t size;
+    dev_t dev;
+    ino_t ino;
+};
+
+struct hasher {
+    struct candidate **todo;
+    size_t count;
+    atomic_size_t next;
+};
+
+static int size_cmp(const void *p1, const void *p2)
+{
+    const struct candidate *c1 = p1, *c2 = p2;
+
+    if (c1->size != c2->size)
+        return c1->size < c2->size ? -1 : 1;
+    return c1->order < c2->order ? -1 : c1->order > c2->order;
+}
+
+/* checksum order, and within that rank, so the last of a run is the
+ * one the merge would have let win anyway */
+static int sum_cmp(const void *p1, const void *p2)
+{
+    const struct candidate *c1 = p1, *c2 = p2;
+    int cmp = strcmp(c1->file->sha256sum, c2->file->sha256sum);
+
+    if (cmp)
+        return cmp;
+    return c1->order < c2->order ? -1 : c1->order > c2->order;
+}
+
+/* Both checksums in one read: the database wants the md5 too, and a
+ * package is parsed right after anyway. */
+static void hash_file(struct pool_file *file)
+{
+    struct file_t map;
+    _cleanup_close_ int fd = openat(file->pool->fd, file->path, O_RDONLY);
+
+    if (fd < 0 || file_from_fd(&map, fd) < 0)
+        return;
+
+    file->md5sum = md5_memory(map.mmap, map.st.st_size);
+    file->sha256sum = sha256_memory(map.mmap, map.st.st_size);
+    file->hashed = file->md5sum && file->sha256sum;
+    file_unmap(&map);
+}
+
+static void *hash_worker(void *arg)
+{
+    struct hasher *h = arg;
+
+    for (;;) {
+        size_t i = atomic_fetch_add(&h->next, 1);
+        if (i >= h->count)
+            break;
+
+        hash_file(h->todo[i]->file);
+    }
+
+    return NULL;
+}
+
+static bool same_contents(const struct pool_file *a, const struct pool_file *b)
+{
+    struct file_t fa, fb;
+    bool same = false;
+
+    _cleanup_close_ int fda = openat(a->pool->fd, a->path, O_RDONLY);
+    _cleanup_close_ int fdb = openat(b->pool->fd, b->path, O_RDONLY);
+    if (fda < 0 || fdb < 0)
+        return false;
+
+    if (file_from_fd(&fa, fda) < 0) {
+        file_unmap(&fa);
+        return false;
+    }
+
+    if (file_from_fd(&fb, fdb) == 0)
+        same = fa.st.st_size == fb.st.st_size &&
+               memcmp(fa.mmap, fb.mmap, fa.st.st_size) == 0;
+
+    file_unmap(&fa);
+    file_unmap(&fb);
+    return same;
+}
+
+/* Swap the copy for a link to the original through a temporary name,
+ * so the copy's path is never missing. */
+static int replace_file(const struct pool_file *original, const struct pool_file *copy,
+                        enum dedup_mode mode)
+{
+    _cleanup_free_ char *tmp = joinstring(copy->path, ".dedup", NULL);
+
+    if (mode == DEDUP_HARDLINK) {
+        if (linkat(original->pool->fd, original->path, copy->pool->fd, tmp, 0) < 0)
+            return -1;
+    } else {
+        struct stat st;
+        _cleanup_close_ int srcfd = openat(original->pool->fd, original->path, O_RDONLY);
+        if (srcfd < 0 || fstatat(copy->pool->fd, copy->path, &st, 0) < 0)
+            return -1;
+
+        _cleanup_close_ int fd = openat(copy->pool->fd, tmp, O_WRONLY | O_CREAT | O_EXCL,
+                                        st.st_mode & 0777);
+        if (fd < 0)
+            return -1;
+
+        /* the copy keeps its own mtime, later runs compare against it */
+        const struct timespec times[2] = { st.st_atim, st.st_mtim };
+        if (ioctl(fd, FICLONE, srcfd) < 0 || futimens(fd, times) < 0) {
+            int saved = errno;
+            unlinkat(copy->pool->fd, tmp, 0);
+            errno = saved;
+            return -1;
+        }
+    }
+
+    if (renameat(copy->pool->fd, tmp, copy->pool->fd, copy->path) < 0) {
+        int saved = errno;
+        unlinkat(copy->pool->fd, tmp, 0);
+        errno = saved;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void dedup_run(struct candidate *run, size_t count, enum dedup_mode mode,
+                      struct dedup_stats *stats)
+{
+    struct candidate *original = &run[count - 1];
+    size_t i;
+
+    for (i = 0; i + 1 < count; ++i) {
+        struct candidate *copy = &run[i];
+        bool same = copy->dev == original->dev && copy->ino == original->ino;
+
+        /* a checksum from the database may be stale, the file replaced
+         * since under the same name and size, so only trust the match
+         * outright when both were read off the pool just now */
+        if (!same && !(copy->file->hashed && original->file->hashed)) {
+            if (!same_contents(original->file, copy->file))
+                continue;
+            same = true;
+        }
+
+        copy->file->same_as = original->file;
+        stats->duplicates++;
+
+        /* already sharing storage, nothing left to reclaim */
+        if (mode == DEDUP_DETECT || (copy->dev == original->dev && copy->ino == original->ino))
+            continue;
+
+        /* make sure before throwing anything away */
+        if (copy->dev != original->dev || (!same && !same_contents(original->file, copy->file)))
+            continue;
+
+        if (replace_file(original->file, copy->file, mode) < 0) {
+            warn("failed to deduplicate %s", copy->file->path);
+            continue;
+        }
+
+        stats->replaced++;
+        stats->saved += copy->size;
+    }
+}
+
+int filecache_dedup(struct filecache *cache, alpm_pkghash_t *known, enum dedup_mode mode,
+                    struct dedup_stats *stats)
+{
+    struct candidate *candidates = calloc(cache->count, sizeof(struct candidate));
+    struct strmap *sums = strmap_new(known ? known->entries : 0);
+    struct hasher h = { 0 };
+    size_t i, j, count = 0;
+    alpm_list_t *node;
+
+    *stats = (struct dedup_stats){ 0 };
+
+    if ((cache->count && !candidates) || !sums)
+        goto error;
+
+    for (i = 0; i < cache->count; ++i) {
+        struct pool_file *file = &cache->files[i];
+        struct stat st;
+
+        if (fstatat(file->pool->fd, file->path, &st, 0) < 0)
+            continue;
+
+        candidates[count++] = (struct candidate){
+            .file  = file,
+            .order = file->rank,
+            .size  = st.st_size,
+            .dev   = st.st_dev,
+            .ino   = st.st_ino
+        };
+    }
+
+    /* only files sharing a size with another can be copies */
+    qsort(candidates, count, sizeof(struct candidate), size_cmp);
+
+    for (node = known ? known->list : NULL; node; node = node->next) {
+        struct pkg *pkg = node->data;
+
+        if (pkg->filename && pkg->sha256sum)
+            strmap_insert(sums, pkg->filename, pkg);
+    }
+
+    h.todo = calloc(count, sizeof(struct candidate *));
+    if (count && !h.todo)
+        goto error;
+
+    for (i = 0; i < count; i = j) {
+        for (j = i + 1; j < count && candidates[j].size == candidates[i].size; ++j)
+            ;
+        if (j - i < 2)
+            continue;
+
+        for (size_t k = i; k < j; ++k) {
+            struct pool_file *file = candidates[k].file;
+            const struct pkg *pkg = strmap_find(sums, file->filename);
+
+            if (pkg && (off_t)pkg->size == candidates[k].size)
+                file->sha256sum = strdup(pkg->sha256sum);
+            else
+                h.todo[h.count++] = &candidates[k];
+        }
+    }
+
+    run_parallel(nr_workers(), hash_worker, &h);
+
+    for (i = 0; i < count; i = j) {
+        for (j = i + 1; j < count && candidates[j].size == candidates[i].size; ++j)
+            ;
+        if (j - i < 2)
+            continue;
+
+        /* a file that couldn't be read can't be anyone's copy */
+        size_t k, n = i;
+        for (k = i; k < j; ++k) {
+            if (candidates[k].file->sha256sum)
+                candidates[n++] = candidates[k];
+        }
+
+        qsort(&candidates[i], n - i, sizeof(struct candidate), sum_cmp);
+
+        for (k = i; k < n; ) {
+            size_t end = k + 1;
+
+            while (end < n && streq(candidates[end].file->sha256sum, candidates[k].file->sha256sum))
+                ++end;
+            if (end - k > 1)
+                dedup_run(&candidates[k], end - k, mode, stats);
+            k = end;
+        }
+    }
+
+    free(h.todo);
+    strmap_free(sums);
+    free(candidates);
+    return 0;
+
+error:
+    strmap_free(sums);
+    free(candidates);
+    return -1;
+}
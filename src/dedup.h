@@ -0,0 +1,47 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include "filecache.h"
+#include "pkghash.h"
+
+enum dedup_mode {
+    /* only skip parsing the copies */
+    DEDUP_DETECT,
+    /* and replace them with hardlinks to the original */
+    DEDUP_HARDLINK,
+    /* or with reflinked copies, so each can still change on its own */
+    DEDUP_REFLINK
+};
+
+struct dedup_stats {
+    size_t duplicates;
+    size_t replaced;
+    off_t saved;
+};
+
+/* Find byte identical packages in the pool by their size and sha256,
+ * taking checksums from known's packages where their size matches and
+ * computing the rest once. A match on a borrowed checksum is compared
+ * byte for byte before it counts. Each copy is pointed at the file
+ * parsed in its place, and depending on mode, made to share its
+ * storage. */
+int filecache_dedup(struct filecache *cache, alpm_pkghash_t *known, enum dedup_mode mode,
+                    struct dedup_stats *stats);
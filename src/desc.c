@@ -24,6 +24,7 @@
 #include <time.h>
 #include <errno.h>
 #include <err.h>
+#include <limits.h>
 
 #include <archive.h>
 #include <archive_entry.h>
@@ -31,6 +32,7 @@
 
 #include "reader.h"
 #include "package.h"
+#include "fields.h"
 #include "util.h"
 
 static inline void read_desc_list(struct archive_reader *reader, alpm_list_t **list)
@@ -40,6 +42,30 @@ static inline void read_desc_list(struct archive_reader *reader, alpm_list_t **l
         *list = alpm_list_add(*list, buf);
 }
 
+static inline int read_desc_files(struct archive_reader *reader, struct filelist *files,
+                                  struct dirtable *dirs)
+{
+    char buf[PATH_MAX];
+    int len;
+
+    /* lines are read straight into the list, not strdup()ed */
+    while ((len = archive_fgets(reader, buf, sizeof(buf))) > 0) {
+        if (filelist_add(files, dirs, buf, len) < 0)
+            return -1;
+    }
+
+    /* a path too long to hold, or a failed read, isn't the end of the
+     * section; carrying on would read the rest as headers */
+    if (len < 0) {
+        if (len == -ERANGE)
+            errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    filelist_compact(files);
+    return 0;
+}
+
 static inline void read_desc_entry(struct archive_reader *reader, char **data)
 {
     archive_getline(reader, data);
@@ -59,73 +85,64 @@ static inline void read_desc_long(struct archive_reader *reader, long *data)
         xstrtol(buf, data);
 }
 
-void read_desc(struct archive *archive, struct pkg *pkg)
+static int read_desc_match(struct archive_reader *reader, const struct field *field,
+                           const char *expected)
+{
+    _cleanup_free_ char *temp = NULL;
+    read_desc_entry(reader, &temp);
+    if (!temp || !streq(temp, expected)) {
+        warnx("database entry %%%s%% and desc record are mismatched!", field->key);
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int read_desc(struct archive *archive, struct pkg *pkg, struct dirtable *dirs)
 {
     struct archive_reader *reader = archive_reader_new(archive);
 
     /* char buf[entry_size]; */
     char buf[8192];
+    int len, ret = 0;
+
+    if (!reader)
+        return -1;
 
     /* FIXME: check -1 might not be the best here. need actual rc */
-    while(archive_fgets(reader, buf, sizeof(buf)) != -1) {
-        if (streq(buf, "%FILENAME%")) {
-            read_desc_entry(reader, &pkg->filename);
-        } else if (streq(buf, "%NAME%")) {
-            _cleanup_free_ char *temp = NULL;
-            read_desc_entry(reader, &temp);
-            if (!streq(temp, pkg->name))
-                errx(EXIT_FAILURE, "database entry %%NAME%% and desc record are mismatched!");
-        } else if (streq(buf, "%BASE%")) {
-            read_desc_entry(reader, &pkg->base);
-        } else if (streq(buf, "%VERSION%")) {
-            _cleanup_free_ char *temp = NULL;
-            read_desc_entry(reader, &temp);
-            if (!streq(temp, pkg->version))
-                errx(EXIT_FAILURE, "database entry %%VERSION%% and desc record are mismatched!");
-        } else if (streq(buf, "%DESC%")) {
-            read_desc_entry(reader, &pkg->desc);
-        } else if (streq(buf, "%GROUPS%")) {
-            read_desc_list(reader, &pkg->groups);
-        } else if (streq(buf, "%CSIZE%")) {
-            read_desc_ulong(reader, &pkg->size);
-        } else if (streq(buf, "%ISIZE%")) {
-            read_desc_ulong(reader, &pkg->isize);
-        } else if (streq(buf, "%MD5SUM%")) {
-            read_desc_entry(reader, &pkg->md5sum);
-        } else if (streq(buf, "%SHA256SUM%")) {
-            read_desc_entry(reader, &pkg->sha256sum);
-        } else if(streq(buf, "%PGPSIG%")) {
-            read_desc_entry(reader, &pkg->base64sig);
-        } else if (streq(buf, "%URL%")) {
-            read_desc_entry(reader, &pkg->url);
-        } else if (streq(buf, "%LICENSE%")) {
-            read_desc_list(reader, &pkg->licenses);
-        } else if (streq(buf, "%ARCH%")) {
-            read_desc_entry(reader, &pkg->arch);
-        } else if (streq(buf, "%BUILDDATE%")) {
-            read_desc_long(reader, &pkg->builddate);
-        } else if (streq(buf, "%PACKAGER%")) {
-            read_desc_entry(reader, &pkg->packager);
-        } else if (streq(buf, "%REPLACES%")) {
-            read_desc_list(reader, &pkg->replaces);
-        } else if (streq(buf, "%DEPENDS%")) {
-            read_desc_list(reader, &pkg->depends);
-        } else if (streq(buf, "%CONFLICTS%")) {
-            read_desc_list(reader, &pkg->conflicts);
-        } else if (streq(buf, "%PROVIDES%")) {
-            read_desc_list(reader, &pkg->provides);
-        } else if (streq(buf, "%OPTDEPENDS%")) {
-            read_desc_list(reader, &pkg->optdepends);
-        } else if (streq(buf, "%MAKEDEPENDS%")) {
-            read_desc_list(reader, &pkg->makedepends);
-        } else if (streq(buf, "%CHECKDEPENDS%")) {
-            read_desc_list(reader, &pkg->checkdepends);
-        } else if (streq(buf, "%FILES%")) {
-            read_desc_list(reader, &pkg->files);
-        }
+    while (ret == 0 && (len = archive_fgets(reader, buf, sizeof(buf))) != -1) {
+        const struct field *field;
+
+        if (len < 3 || buf[0] != '%' || buf[len - 1] != '%')
+            continue;
 
-        /* free(buf); */
+        field = desc_field(&buf[1], len - 2);
+        if (!field)
+            continue;
+
+        switch (field->type) {
+        case FIELD_STRING:
+            read_desc_entry(reader, field_string(pkg, field));
+            break;
+        case FIELD_LIST:
+            read_desc_list(reader, field_list(pkg, field));
+            break;
+        case FIELD_FILES:
+            ret = read_desc_files(reader, field_files(pkg, field), dirs);
+            break;
+        case FIELD_SIZE:
+            read_desc_ulong(reader, field_size(pkg, field));
+            break;
+        case FIELD_TIME:
+            read_desc_long(reader, field_time(pkg, field));
+            break;
+        case FIELD_MATCH:
+            ret = read_desc_match(reader, field, *field_string(pkg, field));
+            break;
+        }
     }
 
     free(reader);
+    return ret;
 }
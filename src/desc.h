@@ -22,4 +22,5 @@
 #include <archive.h>
 #include <archive_entry.h>
 
-void read_desc(struct archive *archive, struct pkg *pkg);
+/* File lists go into dirs. */
+int read_desc(struct archive *archive, struct pkg *pkg, struct dirtable *dirs);
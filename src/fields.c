@@ -0,0 +1,104 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#include "fields.h"
+
+#include <string.h>
+
+/* Both the desc and .PKGINFO keywords are perfectly hashed by their
+ * first and last two characters and their length. The tables are
+ * filled at compile time; should a new key collide with an existing
+ * one, -Woverride-init will complain about the duplicate initializer. */
+#define FIELD_BUCKETS 64
+#define FIELD_HASH(first, penultimate, last, len) \
+    ((3 * (first) + 4 * (penultimate) + 11 * (last) + (len)) & (FIELD_BUCKETS - 1))
+
+#define FIELD(first, penultimate, last, key, type, member) \
+    [FIELD_HASH(first, penultimate, last, sizeof(key) - 1)] = \
+        { key, sizeof(key) - 1, type, offsetof(struct pkg, member) }
+
+static const struct field desc_fields[FIELD_BUCKETS] = {
+    FIELD('F', 'M', 'E', "FILENAME",     FIELD_STRING, filename),
+    FIELD('N', 'M', 'E', "NAME",         FIELD_MATCH,  name),
+    FIELD('B', 'S', 'E', "BASE",         FIELD_STRING, base),
+    FIELD('V', 'O', 'N', "VERSION",      FIELD_MATCH,  version),
+    FIELD('D', 'S', 'C', "DESC",         FIELD_STRING, desc),
+    FIELD('G', 'P', 'S', "GROUPS",       FIELD_LIST,   groups),
+    FIELD('C', 'Z', 'E', "CSIZE",        FIELD_SIZE,   size),
+    FIELD('I', 'Z', 'E', "ISIZE",        FIELD_SIZE,   isize),
+    FIELD('M', 'U', 'M', "MD5SUM",       FIELD_STRING, md5sum),
+    FIELD('S', 'U', 'M', "SHA256SUM",    FIELD_STRING, sha256sum),
+    FIELD('P', 'I', 'G', "PGPSIG",       FIELD_STRING, base64sig),
+    FIELD('U', 'R', 'L', "URL",          FIELD_STRING, url),
+    FIELD('L', 'S', 'E', "LICENSE",      FIELD_LIST,   licenses),
+    FIELD('A', 'C', 'H', "ARCH",         FIELD_STRING, arch),
+    FIELD('B', 'T', 'E', "BUILDDATE",    FIELD_TIME,   builddate),
+    FIELD('P', 'E', 'R', "PACKAGER",     FIELD_STRING, packager),
+    FIELD('R', 'E', 'S', "REPLACES",     FIELD_LIST,   replaces),
+    FIELD('D', 'D', 'S', "DEPENDS",      FIELD_LIST,   depends),
+    FIELD('C', 'T', 'S', "CONFLICTS",    FIELD_LIST,   conflicts),
+    FIELD('P', 'E', 'S', "PROVIDES",     FIELD_LIST,   provides),
+    FIELD('O', 'D', 'S', "OPTDEPENDS",   FIELD_LIST,   optdepends),
+    FIELD('M', 'D', 'S', "MAKEDEPENDS",  FIELD_LIST,   makedepends),
+    FIELD('C', 'D', 'S', "CHECKDEPENDS", FIELD_LIST,   checkdepends),
+    FIELD('F', 'E', 'S', "FILES",        FIELD_FILES,  files),
+};
+
+static const struct field pkginfo_fields[FIELD_BUCKETS] = {
+    FIELD('p', 'm', 'e', "pkgname",     FIELD_STRING, name),
+    FIELD('p', 's', 'e', "pkgbase",     FIELD_STRING, base),
+    FIELD('p', 'e', 'r', "pkgver",      FIELD_STRING, version),
+    FIELD('p', 's', 'c', "pkgdesc",     FIELD_STRING, desc),
+    FIELD('u', 'r', 'l', "url",         FIELD_STRING, url),
+    FIELD('b', 't', 'e', "builddate",   FIELD_TIME,   builddate),
+    FIELD('p', 'e', 'r', "packager",    FIELD_STRING, packager),
+    FIELD('s', 'z', 'e', "size",        FIELD_SIZE,   isize),
+    FIELD('a', 'c', 'h', "arch",        FIELD_STRING, arch),
+    FIELD('g', 'u', 'p', "group",       FIELD_LIST,   groups),
+    FIELD('l', 's', 'e', "license",     FIELD_LIST,   licenses),
+    FIELD('r', 'e', 's', "replaces",    FIELD_LIST,   replaces),
+    FIELD('d', 'n', 'd', "depend",      FIELD_LIST,   depends),
+    FIELD('c', 'c', 't', "conflict",    FIELD_LIST,   conflicts),
+    FIELD('p', 'e', 's', "provides",    FIELD_LIST,   provides),
+    FIELD('o', 'n', 'd', "optdepend",   FIELD_LIST,   optdepends),
+    FIELD('m', 'n', 'd', "makedepend",  FIELD_LIST,   makedepends),
+    FIELD('c', 'n', 'd', "checkdepend", FIELD_LIST,   checkdepends),
+};
+
+static inline const struct field *lookup(const struct field *table, const char *key, size_t len)
+{
+    const struct field *field;
+
+    if (len < 2)
+        return NULL;
+
+    field = &table[FIELD_HASH((unsigned char)key[0], (unsigned char)key[len - 2],
+                              (unsigned char)key[len - 1], len)];
+    if (field->len != len || memcmp(field->key, key, len) != 0)
+        return NULL;
+    return field;
+}
+
+const struct field *desc_field(const char *key, size_t len)
+{
+    return lookup(desc_fields, key, len);
+}
+
+const struct field *pkginfo_field(const char *key, size_t len)
+{
+    return lookup(pkginfo_fields, key, len);
+}
@@ -0,0 +1,70 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <time.h>
+#include <alpm_list.h>
+
+#include "package.h"
+
+enum field_type {
+    FIELD_STRING,
+    FIELD_LIST,
+    FIELD_SIZE,
+    FIELD_TIME,
+    /* a file list, see filelist.h */
+    FIELD_FILES,
+    /* already known, and the record has to agree */
+    FIELD_MATCH
+};
+
+struct field {
+    const char *key;
+    size_t len;
+    enum field_type type;
+    size_t offset;
+};
+
+const struct field *desc_field(const char *key, size_t len);
+const struct field *pkginfo_field(const char *key, size_t len);
+
+static inline char **field_string(struct pkg *pkg, const struct field *field)
+{
+    return (char **)((char *)pkg + field->offset);
+}
+
+static inline alpm_list_t **field_list(struct pkg *pkg, const struct field *field)
+{
+    return (alpm_list_t **)((char *)pkg + field->offset);
+}
+
+static inline struct filelist *field_files(struct pkg *pkg, const struct field *field)
+{
+    return (struct filelist *)((char *)pkg + field->offset);
+}
+
+static inline size_t *field_size(struct pkg *pkg, const struct field *field)
+{
+    return (size_t *)((char *)pkg + field->offset);
+}
+
+static inline time_t *field_time(struct pkg *pkg, const struct field *field)
+{
+    return (time_t *)((char *)pkg + field->offset);
+}
@@ -21,23 +21,73 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 
-int file_from_fd(struct file_t *file, int fd)
+#include "stats.h"
+#include "util.h"
+
+static int map_fd(struct file_t *file, int fd, int flags)
 {
     *file = (struct file_t){ .fd = fd };
 
     fstat(fd, &file->st);
+    stats_open();
+    stats_read(file->st.st_size);
 
-    file->mmap = mmap(NULL, file->st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    file->mmap = mmap(NULL, file->st.st_size, PROT_READ, MAP_SHARED | flags, fd, 0);
     madvise(file->mmap, file->st.st_size, MADV_WILLNEED | MADV_SEQUENTIAL);
 
     return file->mmap == MAP_FAILED ? -errno : 0;
 }
 
+int file_from_fd(struct file_t *file, int fd)
+{
+    return map_fd(file, fd, MAP_POPULATE);
+}
+
+int file_map(struct file_t *file, int fd)
+{
+    return map_fd(file, fd, 0);
+}
+
+int file_unmap(struct file_t *file)
+{
+    return file->mmap != MAP_FAILED ? munmap(file->mmap, file->st.st_size) : 0;
+}
+
 int file_close(struct file_t *file)
 {
     close(file->fd);
-    return file->mmap != MAP_FAILED ? munmap(file->mmap, file->st.st_size) : 0;
+    return file_unmap(file);
+}
+
+int file_physical_offset(int fd, uint64_t *offset)
+{
+    union {
+        struct fiemap map;
+        char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } req;
+
+    zero(&req, sizeof(req));
+    req.map.fm_length = FIEMAP_MAX_OFFSET;
+    req.map.fm_extent_count = 1;
+
+    if (ioctl(fd, FS_IOC_FIEMAP, &req.map) < 0)
+        return -errno;
+
+    /* empty files, or files stored inline in their inode */
+    if (req.map.fm_mapped_extents == 0)
+        return -ENODATA;
+
+    *offset = req.map.fm_extents[0].fe_physical;
+    return 0;
+}
+
+void file_prefetch(int fd)
+{
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
 }
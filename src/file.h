@@ -18,6 +18,7 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/stat.h>
 
 struct file_t {
@@ -27,4 +28,11 @@ struct file_t {
 };
 
 int file_from_fd(struct file_t *file, int fd);
+/* Like file_from_fd(), but without waiting for the whole file to be read
+ * in; pages are faulted in as they're touched. */
+int file_map(struct file_t *file, int fd);
+int file_unmap(struct file_t *file);
 int file_close(struct file_t *file);
+
+int file_physical_offset(int fd, uint64_t *offset);
+void file_prefetch(int fd);
@@ -19,11 +19,17 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <err.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
 
+#include "file.h"
 #include "pkghash.h"
 #include "filters.h"
 #include "util.h"
@@ -31,7 +37,7 @@
 static inline alpm_pkghash_t *pkgcache_add(alpm_pkghash_t *cache, struct pkg *pkg)
 {
     struct pkg *old = _alpm_pkghash_find(cache, pkg->name);
-    int vercmp = old == NULL ? 0 : alpm_pkg_vercmp(pkg->version, old->version);
+    int vercmp = old == NULL ? 0 : version_cmp(&pkg->version_key, &old->version_key);
 
     if (vercmp == 0 || vercmp == 1) {
         if (old) {
@@ -41,32 +47,389 @@ static inline alpm_pkghash_t *pkgcache_add(alpm_pkghash_t *cache, struct pkg *pk
         return _alpm_pkghash_add(cache, pkg);
     }
 
+    /* an older build of something already found */
+    package_free(pkg);
     return cache;
 }
 
-static size_t get_filecache_size(DIR *dirp)
+/* how many packages past those being parsed by every worker to
+ * prefetch */
+#define PREFETCH_WINDOW 8
+
+struct walk_dir {
+    const struct pool *pool;
+    char *path;
+    struct walk_dir *next;
+};
+
+struct walker {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct walk_dir *pending;
+    unsigned int busy;
+    /* the first error hit, which stops the walk */
+    int error;
+
+    struct pool_file *files;
+    size_t count;
+    size_t size;
+};
+
+struct loader {
+    const struct filecache *cache;
+    const struct targets *targets;
+    const char *arch;
+    struct pkg **pkgs;
+    /* how far ahead of the next package to be parsed to prefetch */
+    size_t distance;
+    atomic_size_t next;
+};
+
+bool is_package(const char *name)
+{
+    size_t len = strlen(name);
+
+    if (len > 4 && streq(&name[len - 4], ".sig"))
+        return false;
+    return strstr(name, ".pkg.tar") != NULL;
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+    return dir ? joinstring(dir, "/", name, NULL) : strdup(name);
+}
+
+static int append_file(struct pool_file **files, size_t *count, size_t *size,
+                       const struct pool_file *file)
+{
+    if (*count == *size) {
+        size_t grown = *size ? *size * 2 : 64;
+        struct pool_file *resized = realloc(*files, grown * sizeof(struct pool_file));
+        if (!resized)
+            return -1;
+
+        *files = resized;
+        *size = grown;
+    }
+
+    (*files)[(*count)++] = *file;
+    return 0;
+}
+
+static int push_dir(struct walk_dir **pending, const struct pool *pool, char *path)
+{
+    struct walk_dir *dir = malloc(sizeof(struct walk_dir));
+    if (!dir) {
+        free(path);
+        return -1;
+    }
+
+    *dir = (struct walk_dir){ .pool = pool, .path = path, .next = *pending };
+    *pending = dir;
+    return 0;
+}
+
+static void free_dirs(struct walk_dir *dir)
+{
+    while (dir) {
+        struct walk_dir *next = dir->next;
+
+        free(dir->path);
+        free(dir);
+        dir = next;
+    }
+}
+
+static int open_walk_dir(const struct walk_dir *dir)
 {
-    struct dirent *entry;
+    int fd;
+
+    if (!dir->path) {
+        fd = dup(dir->pool->fd);
+        if (fd >= 0 && lseek(fd, 0, SEEK_SET) < 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        fd = openat(dir->pool->fd, dir->path, O_RDONLY | O_DIRECTORY);
+    }
+
+    if (fd < 0)
+        warn("failed to open %s/%s", dir->pool->path, dir->path ? dir->path : "");
+    return fd;
+}
+
+static int walk_dir(const struct walk_dir *dir, struct pool_file **files, size_t *count,
+                    struct walk_dir **subdirs)
+{
+    int fd = open_walk_dir(dir);
+    if (fd < 0)
+        return -1;
+
+    _cleanup_closedir_ DIR *dirp = fdopendir(fd);
+    const struct dirent *dp;
     size_t size = 0;
 
-    while ((entry = readdir(dirp)) != NULL) {
-        if (entry->d_type == DT_REG || entry->d_type == DT_UNKNOWN)
-            ++size;
+    if (!dirp) {
+        close(fd);
+        return -1;
     }
 
-    rewinddir(dirp);
-    return size;
+    while ((dp = readdir(dirp))) {
+        unsigned char type = dp->d_type;
+
+        if (streq(dp->d_name, ".") || streq(dp->d_name, ".."))
+            continue;
+
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+
+            if (fstatat(dirfd(dirp), dp->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                continue;
+            if (S_ISDIR(st.st_mode))
+                type = DT_DIR;
+            else if (S_ISREG(st.st_mode))
+                type = DT_REG;
+        }
+
+        /* the repository root holds more than packages (an incoming
+         * directory, other architectures, .git), so only pools named
+         * as such are walked into */
+        if (type == DT_DIR && !dir->pool->root) {
+            if (push_dir(subdirs, dir->pool, join_path(dir->path, dp->d_name)) < 0)
+                return -1;
+        } else if (type == DT_REG && is_package(dp->d_name)) {
+            struct pool_file file = {
+                .pool = dir->pool,
+                .path = join_path(dir->path, dp->d_name),
+                .key  = dp->d_ino
+            };
+
+            if (append_file(files, count, &size, &file) < 0) {
+                free(file.path);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void *walk_worker(void *arg)
+{
+    struct walker *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        struct walk_dir *dir, *subdirs = NULL;
+        struct pool_file *files = NULL;
+        size_t i, count = 0;
+
+        while (!w->pending && w->busy && !w->error)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (!w->pending || w->error)
+            break;
+
+        dir = w->pending;
+        w->pending = dir->next;
+        w->busy++;
+        pthread_mutex_unlock(&w->lock);
+
+        int ret = walk_dir(dir, &files, &count, &subdirs);
+        int error = errno;
+        free(dir->path);
+        free(dir);
+
+        pthread_mutex_lock(&w->lock);
+        if (ret < 0 && !w->error)
+            w->error = error;
+
+        for (i = 0; i < count; ++i) {
+            if (!w->error && append_file(&w->files, &w->count, &w->size, &files[i]) < 0)
+                w->error = errno;
+            if (w->error)
+                free(files[i].path);
+        }
+
+        while (subdirs) {
+            dir = subdirs;
+            subdirs = dir->next;
+            dir->next = w->pending;
+            w->pending = dir;
+        }
+
+        w->busy--;
+        pthread_cond_broadcast(&w->cond);
+        free(files);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+static int pool_file_cmp(const void *p1, const void *p2)
+{
+    const struct pool_file *f1 = p1, *f2 = p2;
+
+    if (f1->key != f2->key)
+        return f1->key < f2->key ? -1 : 1;
+    return 0;
+}
+
+/* readdir() order has nothing to do with where packages live on disk.
+ * Visit them in inode order, and if the filesystem can tell us where
+ * the data physically starts, in block order, to keep cold scans from
+ * being dominated by seeks. */
+static void sort_files(struct pool_file *files, size_t count)
+{
+    size_t i;
+
+    if (!count)
+        return;
+
+    qsort(files, count, sizeof(struct pool_file), pool_file_cmp);
+
+    for (i = 0; i < count; ++i) {
+        _cleanup_close_ int fd = openat(files[i].pool->fd, files[i].path, O_RDONLY);
+        uint64_t offset;
+
+        if (fd < 0)
+            continue;
+
+        int ret = file_physical_offset(fd, &offset);
+        if (ret == -EOPNOTSUPP || ret == -ENOTTY)
+            return;
+
+        /* data stored inline lives next to the inode tables */
+        files[i].key = ret == 0 ? offset : 0;
+    }
+
+    qsort(files, count, sizeof(struct pool_file), pool_file_cmp);
+}
+
+static int rank_cmp(const void *p1, const void *p2)
+{
+    const struct pool_file *f1 = *(struct pool_file *const *)p1;
+    const struct pool_file *f2 = *(struct pool_file *const *)p2;
+
+    /* the pools all come from one array, in the order they were given */
+    if (f1->pool != f2->pool)
+        return f1->pool < f2->pool ? -1 : 1;
+    return strcmp(f1->path, f2->path);
+}
+
+/* Rank the files so that whenever two could stand for the same package,
+ * which one wins doesn't depend on where they ended up on disk. */
+static struct pool_file **rank_files(struct pool_file *files, size_t count)
+{
+    struct pool_file **ranked = malloc(count * sizeof(struct pool_file *));
+    size_t i;
+
+    if (count && !ranked)
+        return NULL;
+
+    for (i = 0; i < count; ++i)
+        ranked[i] = &files[i];
+    qsort(ranked, count, sizeof(struct pool_file *), rank_cmp);
+
+    for (i = 0; i < count; ++i)
+        ranked[i]->rank = i;
+    return ranked;
+}
+
+int filecache_scan(struct filecache *cache, const struct pool *pools, size_t count)
+{
+    struct walker w = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER
+    };
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        if (push_dir(&w.pending, &pools[i], NULL) < 0) {
+            free_dirs(w.pending);
+            return -1;
+        }
+    }
+
+    /* every directory is its own unit of work, so a sharded pool is
+     * walked by all workers at once */
+    run_parallel(nr_workers(), walk_worker, &w);
+
+    if (w.error) {
+        free_dirs(w.pending);
+        for (i = 0; i < w.count; ++i)
+            free(w.files[i].path);
+        free(w.files);
+        errno = w.error;
+        return -1;
+    }
+
+    sort_files(w.files, w.count);
+
+    *cache = (struct filecache){
+        .files = w.files,
+        .count = w.count,
+        .index = strmap_new(w.count)
+    };
+
+    _cleanup_free_ struct pool_file **ranked = rank_files(cache->files, cache->count);
+    if (!cache->index || (cache->count && !ranked))
+        return -1;
+
+    /* backwards, so a name maps to the same file the merge lets win */
+    for (i = cache->count; i-- > 0;) {
+        struct pool_file *file = ranked[i];
+        const char *slash = strrchr(file->path, '/');
+
+        /* packages linked into the root are flattened to their basename */
+        file->filename = file->pool->root || !slash ? file->path : slash + 1;
+
+        if (!strmap_find(cache->index, file->filename))
+            strmap_insert(cache->index, file->filename, file);
+    }
+
+    return 0;
+}
+
+void filecache_free(struct filecache *cache)
+{
+    size_t i;
+
+    for (i = 0; i < cache->count; ++i) {
+        free(cache->files[i].path);
+        free(cache->files[i].md5sum);
+        free(cache->files[i].sha256sum);
+    }
+    free(cache->files);
+    strmap_free(cache->index);
+}
+
+const struct pool_file *filecache_find(const struct filecache *cache, const char *filename)
+{
+    return strmap_find(cache->index, filename);
+}
+
+static void prefetch_file(const struct pool_file *file)
+{
+    _cleanup_close_ int fd = openat(file->pool->fd, file->path, O_RDONLY);
+
+    if (fd >= 0)
+        file_prefetch(fd);
 }
 
-static struct pkg *load_from_file(int dirfd, const char *filename, const char *arch)
+static struct pkg *load_from_file(const struct pool_file *file, const char *arch)
 {
-    _cleanup_close_ int pkgfd = openat(dirfd, filename, O_RDONLY);
+    /* the pool may have changed since it was scanned */
+    _cleanup_close_ int pkgfd = openat(file->pool->fd, file->path, O_RDONLY);
     if (pkgfd < 0) {
-        err(EXIT_FAILURE, "failed to open %s", filename);
+        warn("failed to open %s", file->path);
+        return NULL;
     }
 
-    struct pkg *pkg = malloc(sizeof(pkg_t));
-    zero(pkg, sizeof(pkg_t));
+    struct pkg *pkg = calloc(1, sizeof(pkg_t));
+    if (!pkg)
+        return NULL;
 
     if (load_package(pkg, pkgfd) < 0)
         goto error;
@@ -74,7 +437,13 @@ static struct pkg *load_from_file(int dirfd, const char *filename, const char *a
     if (arch && pkg->arch && !match_arch(pkg, arch))
         goto error;
 
-    pkg->filename = strdup(filename);
+    pkg->filename = strdup(file->filename);
+    pkg->path = strdup(file->path);
+    pkg->pool = file->pool;
+    if (file->hashed) {
+        pkg->md5sum = strdup(file->md5sum);
+        pkg->sha256sum = strdup(file->sha256sum);
+    }
     return pkg;
 
 error:
@@ -82,41 +451,326 @@ error:
     return NULL;
 }
 
-static alpm_pkghash_t *scan_for_targets(alpm_pkghash_t *cache, int dirfd, DIR *dirp,
-                                        alpm_list_t *targets, const char *arch)
+static void *load_worker(void *arg)
 {
-    const struct dirent *dp;
+    struct loader *l = arg;
+    const struct filecache *cache = l->cache;
 
-    while ((dp = readdir(dirp))) {
-        if (dp->d_type != DT_REG && dp->d_type != DT_UNKNOWN)
-            continue;
+    for (;;) {
+        size_t i = atomic_fetch_add(&l->next, 1);
+        if (i >= cache->count)
+            break;
 
-        struct pkg *pkg = load_from_file(dirfd, dp->d_name, arch);
-        if (!pkg)
+        /* keep the next few packages' reads in flight while parsing
+         * the current one so that I/O overlaps with decompression. The
+         * packages just past i are already taken by other workers */
+        size_t ahead = i + l->distance;
+        if (ahead < cache->count && !cache->files[ahead].same_as)
+            prefetch_file(&cache->files[ahead]);
+
+        /* a copy of another package is that package, parsing it again
+         * would only give the same answer */
+        if (cache->files[i].same_as)
             continue;
 
-        if (targets == NULL || match_targets(pkg, targets))
-            cache = pkgcache_add(cache, pkg);
+        struct pkg *pkg = load_from_file(&cache->files[i], l->arch);
+        if (pkg && l->targets && !match_targets(l->targets, pkg)) {
+            package_free(pkg);
+            pkg = NULL;
+        }
+
+        l->pkgs[cache->files[i].rank] = pkg;
     }
 
-    return cache;
+    return NULL;
+}
+
+alpm_pkghash_t *get_filecache(const struct filecache *cache, const struct targets *targets,
+                              const char *arch)
+{
+    const unsigned int workers = nr_workers();
+    struct loader l = {
+        .cache    = cache,
+        .targets  = targets,
+        .arch     = arch,
+        .pkgs     = calloc(cache->count, sizeof(struct pkg *)),
+        .distance = workers + PREFETCH_WINDOW
+    };
+    size_t i;
+
+    if (cache->count && !l.pkgs)
+        return NULL;
+
+    for (i = 0; i < cache->count && i < l.distance; ++i)
+        prefetch_file(&cache->files[i]);
+
+    run_parallel(workers, load_worker, &l);
+
+    /* merge by rank so that ties are always broken the same way */
+    alpm_pkghash_t *pkgcache = _alpm_pkghash_create(cache->count);
+    for (i = 0; i < cache->count; ++i) {
+        if (l.pkgs[i])
+            pkgcache = pkgcache_add(pkgcache, l.pkgs[i]);
+    }
+
+    free(l.pkgs);
+    return pkgcache;
 }
 
-alpm_pkghash_t *get_filecache(int dirfd, alpm_list_t *targets, const char *arch)
+struct ingest {
+    int dirfd;
+    const struct pool *pool;
+    const struct targets *targets;
+    const char *arch;
+    char **names;
+    struct pkg **pkgs;
+    size_t count;
+    atomic_size_t next;
+};
+
+/* Not every filesystem can copy_file_range() across to another, so
+ * finish whatever it couldn't do with plain reads and writes. Returns
+ * how far the copy got. */
+static off_t copy_data(int srcfd, int fd, off_t done, off_t size)
 {
-    int dupfd = dup(dirfd);
-    if (dupfd < 0)
-        err(EXIT_FAILURE, "failed to duplicate fd");
+    char buf[BUFSIZ];
 
-    if (lseek(dupfd, 0, SEEK_SET) < 0)
-        err(EXIT_FAILURE, "failed to lseek");
+    while (done < size) {
+        ssize_t nbytes_r = pread(srcfd, buf, sizeof(buf), done);
+        if (nbytes_r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (nbytes_r == 0)
+            break;
+
+        for (ssize_t written = 0; written < nbytes_r;) {
+            ssize_t nbytes_w = write(fd, buf + written, nbytes_r - written);
+            if (nbytes_w < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            written += nbytes_w;
+        }
+
+        done += nbytes_r;
+    }
+
+    return done;
+}
+
+/* The original is deleted once this returns, so anything short of a
+ * whole copy safely on disk is a failure. */
+static int copy_file(int srcfd, int fd, const struct stat *st)
+{
+    off_t done = 0;
+
+    while (done < st->st_size) {
+        ssize_t nbytes = copy_file_range(srcfd, &done, fd, NULL, st->st_size - done, 0);
+        if (nbytes < 0) {
+            if (errno != EXDEV && errno != EOPNOTSUPP && errno != ENOSYS && errno != EINVAL)
+                return -1;
+            done = copy_data(srcfd, fd, done, st->st_size);
+            if (done < 0)
+                return -1;
+            break;
+        }
+        if (nbytes == 0)
+            break;
+    }
+
+    /* the file shrank since it was looked at */
+    if (done != st->st_size) {
+        errno = EIO;
+        return -1;
+    }
+
+    /* keep the mtime, later runs compare against it */
+    const struct timespec times[2] = { st->st_atim, st->st_mtim };
+    if (futimens(fd, times) < 0)
+        return -1;
+    return fsync(fd);
+}
+
+/* Rename when we can, otherwise copy the file across and drop the
+ * original. Neither ever replaces a file already at the destination;
+ * that fails with EEXIST and leaves the original where it was. */
+static int move_file(int fromfd, const char *name, int tofd)
+{
+    struct stat st;
+
+    if (renameat2(fromfd, name, tofd, name, RENAME_NOREPLACE) == 0)
+        return 0;
+    /* EINVAL when the filesystem can't promise not to replace */
+    if (errno != EXDEV && errno != EINVAL)
+        return -1;
+
+    _cleanup_close_ int srcfd = openat(fromfd, name, O_RDONLY);
+    if (srcfd < 0 || fstat(srcfd, &st) < 0)
+        return -1;
+
+    _cleanup_close_ int fd = openat(tofd, name, O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 0777);
+    if (fd < 0)
+        return -1;
+
+    if (copy_file(srcfd, fd, &st) < 0) {
+        int saved = errno;
+        unlinkat(tofd, name, 0);
+        errno = saved;
+        return -1;
+    }
+
+    return unlinkat(fromfd, name, 0);
+}
+
+int ingest_move(struct pkg *pkg, const struct pool *pool)
+{
+    _cleanup_free_ char *signame = joinstring(pkg->path, ".sig", NULL);
+
+    if (move_file(pkg->pool->fd, pkg->path, pool->fd) < 0) {
+        if (errno == EEXIST)
+            warnx("%s is already in %s, leaving it", pkg->path, pool->path);
+        else
+            warn("failed to move %s into %s", pkg->path, pool->path);
+        return -1;
+    }
+
+    if (move_file(pkg->pool->fd, signame, pool->fd) < 0 && errno != ENOENT) {
+        if (errno == EEXIST)
+            warnx("%s is already in %s, leaving it", signame, pool->path);
+        else
+            warn("failed to move %s into %s", signame, pool->path);
+    }
+
+    pkg->pool = pool;
+    return 0;
+}
+
+static struct pkg *ingest_file(const struct ingest *in, const char *name)
+{
+    struct file_t file;
+    _cleanup_close_ int fd = openat(in->dirfd, name, O_RDONLY);
+
+    if (fd < 0) {
+        warn("failed to open %s", name);
+        return NULL;
+    }
+
+    struct pkg *pkg = calloc(1, sizeof(pkg_t));
+    if (!pkg)
+        return NULL;
+
+    if (file_from_fd(&file, fd) < 0)
+        goto error;
+
+    /* everything we need from the package comes from this one read */
+    if (load_package_file(pkg, &file) < 0) {
+        warnx("%s is not a valid package", name);
+        goto error;
+    }
+
+    if (in->arch && pkg->arch && !match_arch(pkg, in->arch))
+        goto error;
+    if (in->targets && !match_targets(in->targets, pkg))
+        goto error;
+
+    pkg->md5sum = md5_memory(file.mmap, file.st.st_size);
+    pkg->sha256sum = sha256_memory(file.mmap, file.st.st_size);
+    file_unmap(&file);
+
+    pkg->filename = strdup(name);
+    pkg->path = strdup(name);
+    pkg->pool = in->pool;
+    load_package_signature(pkg, in->dirfd);
+    return pkg;
+
+error:
+    file_unmap(&file);
+    package_free(pkg);
+    return NULL;
+}
+
+static void *ingest_worker(void *arg)
+{
+    struct ingest *in = arg;
+
+    for (;;) {
+        size_t i = atomic_fetch_add(&in->next, 1);
+        if (i >= in->count)
+            break;
+
+        in->pkgs[i] = ingest_file(in, in->names[i]);
+    }
+
+    return NULL;
+}
+
+static int strcmpp(const void *p1, const void *p2)
+{
+    return strcmp(*(char *const *)p1, *(char *const *)p2);
+}
+
+alpm_pkghash_t *ingest_packages(alpm_pkghash_t *pkgcache, int dirfd, const struct pool *pool,
+                                const struct targets *targets, const char *arch)
+{
+    struct ingest in = {
+        .dirfd   = dirfd,
+        .pool    = pool,
+        .targets = targets,
+        .arch    = arch
+    };
+    size_t i, size = 0;
+
+    _cleanup_closedir_ DIR *dirp = fdopendir(dup(dirfd));
+    const struct dirent *dp;
 
-    _cleanup_closedir_ DIR *dirp = fdopendir(dupfd);
     if (!dirp)
-        err(EXIT_FAILURE, "fdopendir failed");
+        return NULL;
+    rewinddir(dirp);
+
+    while ((dp = readdir(dirp))) {
+        if (!is_package(dp->d_name))
+            continue;
+
+        if (in.count == size) {
+            char **resized = realloc(in.names, (size ? size * 2 : 64) * sizeof(char *));
+            if (!resized)
+                goto error;
+
+            in.names = resized;
+            size = size ? size * 2 : 64;
+        }
+
+        if (!(in.names[in.count] = strdup(dp->d_name)))
+            goto error;
+        in.count++;
+    }
+
+    /* keep which of two builds of a package wins independent of
+     * readdir() order */
+    qsort(in.names, in.count, sizeof(char *), strcmpp);
 
-    size_t size = get_filecache_size(dirp);
-    alpm_pkghash_t *cache = _alpm_pkghash_create(size);
+    in.pkgs = calloc(in.count, sizeof(struct pkg *));
+    if (in.count && !in.pkgs)
+        goto error;
+
+    run_parallel(nr_workers(), ingest_worker, &in);
+
+    for (i = 0; i < in.count; ++i) {
+        if (in.pkgs[i])
+            pkgcache = pkgcache_add(pkgcache, in.pkgs[i]);
+        free(in.names[i]);
+    }
 
-    return scan_for_targets(cache, dirfd, dirp, targets, arch);
+    free(in.names);
+    free(in.pkgs);
+    return pkgcache;
+
+error:
+    for (i = 0; i < in.count; ++i)
+        free(in.names[i]);
+    free(in.names);
+    return NULL;
 }
@@ -18,7 +18,58 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <alpm_list.h>
 #include "pkghash.h"
+#include "strmap.h"
+#include "filters.h"
 
-alpm_pkghash_t *get_filecache(int dirfd, alpm_list_t *targets, const char *arch);
+struct pool {
+    const char *path;
+    int fd;
+    /* packages are served straight out of this pool rather than
+     * through symlinks in the repository root */
+    bool root;
+};
+
+struct pool_file {
+    const struct pool *pool;
+    char *path;
+    const char *filename;
+    uint64_t key;
+    /* position by pool, then path, which unlike the order files are
+     * read in is the same on every host */
+    size_t rank;
+    /* known ahead of parsing, when deduplicating */
+    char *md5sum;
+    char *sha256sum;
+    /* whether the sums were read off the file itself, rather than
+     * taken from a database that may predate it */
+    bool hashed;
+    /* an identical file that's parsed in this one's place */
+    const struct pool_file *same_as;
+};
+
+struct filecache {
+    struct pool_file *files;
+    size_t count;
+    struct strmap *index;
+};
+
+bool is_package(const char *name);
+
+int filecache_scan(struct filecache *cache, const struct pool *pools, size_t count);
+void filecache_free(struct filecache *cache);
+
+const struct pool_file *filecache_find(const struct filecache *cache, const char *filename);
+alpm_pkghash_t *get_filecache(const struct filecache *cache, const struct targets *targets,
+                              const char *arch);
+
+/* Parse and checksum every package in pool, which is the incoming
+ * directory, and add them to pkgcache. Nothing is moved yet. */
+alpm_pkghash_t *ingest_packages(alpm_pkghash_t *pkgcache, int dirfd, const struct pool *pool,
+                                const struct targets *targets, const char *arch);
+
+/* Move an ingested package, along with its signature, into pool, once
+ * it's been accepted. A file already there is never replaced. */
+int ingest_move(struct pkg *pkg, const struct pool *pool);
@@ -0,0 +1,211 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#include "filelist.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "strmap.h"
+
+struct dir {
+    char *path;
+    size_t len;
+};
+
+void dirtable_init(struct dirtable *table)
+{
+    *table = (struct dirtable){ 0 };
+    pthread_mutex_init(&table->lock, NULL);
+}
+
+void dirtable_free(struct dirtable *table)
+{
+    size_t i;
+
+    /* the index's keys are the paths themselves */
+    for (i = 0; i < table->count; ++i)
+        free(table->dirs[i].path);
+    free(table->dirs);
+    strmap_free(table->index);
+    pthread_mutex_destroy(&table->lock);
+    *table = (struct dirtable){ 0 };
+}
+
+static int intern_dir(struct dirtable *table, const char *path, size_t len,
+                      uint32_t *id, const char **interned)
+{
+    char key[len + 1];
+    void *found;
+    int ret = 0;
+
+    memcpy(key, path, len);
+    key[len] = 0;
+
+    pthread_mutex_lock(&table->lock);
+
+    if (!table->index && !(table->index = strmap_new(1024))) {
+        ret = -1;
+        goto out;
+    }
+
+    found = strmap_find(table->index, key);
+    if (found) {
+        *id = (uintptr_t)found - 1;
+        *interned = table->dirs[*id].path;
+        goto out;
+    }
+
+    if (table->count == table->size) {
+        size_t size = table->size ? table->size * 2 : 1024;
+        struct dir *dirs = realloc(table->dirs, size * sizeof(struct dir));
+        if (!dirs) {
+            ret = -1;
+            goto out;
+        }
+
+        table->dirs = dirs;
+        table->size = size;
+    }
+
+    char *copy = strdup(key);
+    if (!copy || strmap_insert(table->index, copy, (void *)(uintptr_t)(table->count + 1)) < 0) {
+        free(copy);
+        ret = -1;
+        goto out;
+    }
+
+    table->dirs[table->count] = (struct dir){ copy, len };
+    *id = table->count++;
+    *interned = copy;
+
+out:
+    pthread_mutex_unlock(&table->lock);
+    return ret;
+}
+
+int filelist_add(struct filelist *list, struct dirtable *table, const char *path, size_t len)
+{
+    size_t dirlen = len;
+    uint32_t id;
+
+    /* split after the last slash, not counting a trailing one */
+    if (dirlen && path[dirlen - 1] == '/')
+        --dirlen;
+    while (dirlen && path[dirlen - 1] != '/')
+        --dirlen;
+
+    if (list->last_dir && list->last_len == dirlen && memcmp(list->last_dir, path, dirlen) == 0) {
+        id = list->last_id;
+    } else {
+        const char *interned;
+
+        if (intern_dir(table, path, dirlen, &id, &interned) < 0)
+            return -1;
+
+        list->table = table;
+        list->last_dir = interned;
+        list->last_len = dirlen;
+        list->last_id = id;
+    }
+
+    if (list->count == list->size) {
+        size_t size = list->size ? list->size * 2 : 64;
+        uint32_t *dirs = realloc(list->dirs, size * sizeof(uint32_t));
+        if (!dirs)
+            return -1;
+
+        list->dirs = dirs;
+        list->size = size;
+    }
+
+    size_t leaflen = len - dirlen + 1;
+    if (list->len + leaflen > list->buflen) {
+        size_t buflen = list->buflen ? list->buflen : 1024;
+        while (buflen < list->len + leaflen)
+            buflen *= 2;
+
+        char *leaves = realloc(list->leaves, buflen);
+        if (!leaves)
+            return -1;
+
+        list->leaves = leaves;
+        list->buflen = buflen;
+    }
+
+    memcpy(&list->leaves[list->len], &path[dirlen], leaflen - 1);
+    list->leaves[list->len + leaflen - 1] = 0;
+    list->len += leaflen;
+
+    list->dirs[list->count++] = id;
+    return 0;
+}
+
+void filelist_compact(struct filelist *list)
+{
+    /* realloc() to nothing may free, or hand back a new allocation */
+    if (!list->count)
+        return;
+
+    uint32_t *dirs = realloc(list->dirs, list->count * sizeof(uint32_t));
+    char *leaves = realloc(list->leaves, list->len);
+
+    /* shrinking can't fail to keep what's there */
+    if (dirs) {
+        list->dirs = dirs;
+        list->size = list->count;
+    }
+    if (leaves) {
+        list->leaves = leaves;
+        list->buflen = list->len;
+    }
+}
+
+void filelist_free(struct filelist *list)
+{
+    free(list->dirs);
+    free(list->leaves);
+    *list = (struct filelist){ 0 };
+}
+
+int filelist_write(const struct filelist *list, buffer_t *buf)
+{
+    const char *leaf = list->leaves;
+    size_t i;
+    int ret = 0;
+
+    if (!list->count)
+        return 0;
+
+    pthread_mutex_lock(&list->table->lock);
+    for (i = 0; i < list->count && ret == 0; ++i) {
+        const struct dir *dir = &list->table->dirs[list->dirs[i]];
+        size_t leaflen = strlen(leaf);
+
+        if (buffer_append(buf, dir->path, dir->len) < 0 ||
+            buffer_append(buf, leaf, leaflen) < 0 ||
+            buffer_putc(buf, '\n') < 0)
+            ret = -1;
+
+        leaf += leaflen + 1;
+    }
+    pthread_mutex_unlock(&list->table->lock);
+
+    return ret;
+}
@@ -0,0 +1,78 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "strbuf.h"
+
+struct dir;
+
+/* File lists are mostly the same few directories over and over. Each
+ * directory is kept once, in a table shared by every list of a repo,
+ * and a list only holds, per path, the id of its parent directory and
+ * its last component. A directory entry like "usr/lib/" is stored as
+ * "lib/" under "usr/", so paths come back out exactly as they went in.
+ * Directories are only ever added, so an id stays good until the table
+ * is freed, which has to wait for every list using it. */
+struct dirtable {
+    pthread_mutex_t lock;
+    struct strmap *index;
+    struct dir *dirs;
+    size_t count;
+    size_t size;
+};
+
+void dirtable_init(struct dirtable *table);
+void dirtable_free(struct dirtable *table);
+
+struct filelist {
+    /* where the directories are, from the first path on */
+    struct dirtable *table;
+
+    uint32_t *dirs;
+    size_t count;
+    size_t size;
+
+    /* the last components, each NUL terminated, one after the other */
+    char *leaves;
+    size_t len;
+    size_t buflen;
+
+    /* paths come grouped by directory, so remember the last one */
+    const char *last_dir;
+    size_t last_len;
+    uint32_t last_id;
+};
+
+int filelist_add(struct filelist *list, struct dirtable *table, const char *path, size_t len);
+void filelist_free(struct filelist *list);
+
+/* Give back the room left over for more paths, once there won't be any. */
+void filelist_compact(struct filelist *list);
+
+/* Append every path to buf, each on its own line. */
+int filelist_write(const struct filelist *list, buffer_t *buf);
+
+/* What the list costs on top of the shared directories. */
+static inline size_t filelist_memory(const struct filelist *list)
+{
+    return list->size * sizeof(uint32_t) + list->buflen;
+}
@@ -17,26 +17,178 @@
 
 #include "filters.h"
 
+#include <stdlib.h>
+#include <string.h>
 #include <fnmatch.h>
+#include "strmap.h"
 #include "util.h"
 
-bool match_target(struct pkg *pkg, const char *target, const char *fullname)
+static int compile_stars(struct target *t)
 {
-    if (streq(target, pkg->filename))
+    const char *p = t->pattern, *star;
+    size_t i = 0;
+
+    t->run_count = 1;
+    for (star = p; (star = strchr(star, '*')); ++star)
+        ++t->run_count;
+
+    t->runs = malloc(t->run_count * sizeof(struct target_run));
+    if (!t->runs)
+        return -1;
+
+    for (;;) {
+        star = strchrnul(p, '*');
+        t->runs[i++] = (struct target_run){ .str = p, .len = star - p };
+        if (!*star)
+            break;
+        p = star + 1;
+    }
+
+    return 0;
+}
+
+static int compile_target(struct target *t, const char *pattern)
+{
+    *t = (struct target){ .pattern = pattern };
+
+    if (strpbrk(pattern, "?[\\"))
+        t->kind = TARGET_GLOB;
+    else if (strchr(pattern, '*'))
+        t->kind = TARGET_STARS;
+    else
+        t->kind = TARGET_LITERAL;
+
+    return t->kind == TARGET_STARS ? compile_stars(t) : 0;
+}
+
+struct targets *compile_targets(alpm_list_t *list)
+{
+    struct targets *targets;
+    const alpm_list_t *node;
+    size_t count = alpm_list_count(list);
+
+    if (!count)
+        return NULL;
+
+    targets = calloc(1, sizeof(struct targets));
+    if (!targets)
+        return NULL;
+
+    targets->items = calloc(count, sizeof(struct target));
+    targets->patterns = calloc(count, sizeof(struct target *));
+    targets->exact = strmap_new(count);
+    if (!targets->items || !targets->patterns || !targets->exact)
+        goto error;
+
+    for (node = list; node; node = node->next) {
+        struct target *t = &targets->items[targets->count++];
+
+        if (compile_target(t, node->data) < 0)
+            goto error;
+        if (strmap_insert(targets->exact, t->pattern, t) < 0)
+            goto error;
+        if (t->kind != TARGET_LITERAL)
+            targets->patterns[targets->pattern_count++] = t;
+    }
+
+    return targets;
+
+error:
+    free_targets(targets);
+    return NULL;
+}
+
+void free_targets(struct targets *targets)
+{
+    size_t i;
+
+    if (!targets)
+        return;
+
+    for (i = 0; i < targets->count; ++i)
+        free(targets->items[i].runs);
+
+    if (targets->exact)
+        strmap_free(targets->exact);
+    free(targets->patterns);
+    free(targets->items);
+    free(targets);
+}
+
+/* With only '*' as a wildcard, the first and last runs are anchored to
+ * either end and the ones in between can be found left to right, taking
+ * the first occurrence each time, without ever backtracking. */
+static bool match_stars(const struct target *t, const char *str, size_t len)
+{
+    const struct target_run *first = &t->runs[0], *last = &t->runs[t->run_count - 1];
+    const char *p, *end;
+    size_t i;
+
+    if (len < first->len + last->len)
+        return false;
+    if (memcmp(str, first->str, first->len) != 0)
+        return false;
+    if (memcmp(str + len - last->len, last->str, last->len) != 0)
+        return false;
+
+    p = str + first->len;
+    end = str + len - last->len;
+
+    for (i = 1; i + 1 < t->run_count; ++i) {
+        const struct target_run *run = &t->runs[i];
+        const char *found = memmem(p, end - p, run->str, run->len);
+
+        if (!found)
+            return false;
+        p = found + run->len;
+    }
+
+    return true;
+}
+
+static bool match_exact(const struct targets *targets, const struct pkg *pkg,
+                        const char *fullname)
+{
+    const struct target *t;
+
+    if (strmap_find_hashed(targets->exact, pkg->name, pkg->name_hash))
         return true;
-    else if (streq(target, pkg->name))
+    if (pkg->filename && strmap_find(targets->exact, pkg->filename))
         return true;
-    return fnmatch(target, fullname, 0) == 0;
+
+    /* only a literal matches the full name on its text alone */
+    t = strmap_find(targets->exact, fullname);
+    return t && t->kind == TARGET_LITERAL;
 }
 
-bool match_targets(struct pkg *pkg, alpm_list_t *targets)
+bool match_targets(const struct targets *targets, const struct pkg *pkg)
 {
-    const alpm_list_t *node;
-    _cleanup_free_ char *fullname = joinstring(pkg->name, "-", pkg->version, NULL);
-    bool ret = false;
+    size_t name_len = strlen(pkg->name), version_len = strlen(pkg->version);
+    size_t len = name_len + 1 + version_len, i;
+    _cleanup_free_ char *heap = NULL;
+    char stack[256], *fullname = stack;
+
+    /* build "name-version" without allocating, unless it's huge */
+    if (len >= sizeof(stack)) {
+        fullname = heap = malloc(len + 1);
+        if (!fullname)
+            return false;
+    }
+
+    memcpy(fullname, pkg->name, name_len);
+    fullname[name_len] = '-';
+    memcpy(&fullname[name_len + 1], pkg->version, version_len + 1);
+
+    if (match_exact(targets, pkg, fullname))
+        return true;
+
+    for (i = 0; i < targets->pattern_count; ++i) {
+        const struct target *t = targets->patterns[i];
 
-    for (node = targets; node && !ret; node = node->next)
-        ret = match_target(pkg, node->data, fullname);
+        if (t->kind == TARGET_STARS ? match_stars(t, fullname, len)
+                                    : fnmatch(t->pattern, fullname, 0) == 0)
+            return true;
+    }
 
-    return ret;
+    return false;
 }
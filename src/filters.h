@@ -17,11 +17,46 @@
 
 #pragma once
 
+#include <stddef.h>
 #include "package.h"
 #include "util.h"
 
-bool match_target(struct pkg *pkg, const char *target, const char *fullname);
-bool match_targets(struct pkg *pkg, alpm_list_t *targets);
+enum target_kind {
+    TARGET_LITERAL,
+    TARGET_STARS,
+    TARGET_GLOB
+};
+
+struct target_run {
+    const char *str;
+    size_t len;
+};
+
+struct target {
+    const char *pattern;
+    enum target_kind kind;
+    /* for TARGET_STARS, the literal text around and between the stars */
+    struct target_run *runs;
+    size_t run_count;
+};
+
+/* The targets given on the command line, classified once up front. A
+ * package matches a target if it's the package's filename, its name, or
+ * a glob matching "name-version". Any target's exact text is looked up in
+ * a hash, so only patterns are tried one by one: those with nothing but
+ * '*' wildcards by a simple scan, and the rest through fnmatch(3). */
+struct targets {
+    struct target *items;
+    size_t count;
+    struct strmap *exact;
+    struct target **patterns;
+    size_t pattern_count;
+};
+
+struct targets *compile_targets(alpm_list_t *list);
+void free_targets(struct targets *targets);
+
+bool match_targets(const struct targets *targets, const struct pkg *pkg);
 
 static inline bool match_arch(struct pkg *pkg, const char *arch) {
     return streq(pkg->arch, arch) || streq(pkg->arch, "any");
@@ -0,0 +1,392 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#include "index.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "package.h"
+#include "strbuf.h"
+#include "util.h"
+
+struct table {
+    struct index_entry *entries;
+    size_t count;
+    size_t size;
+};
+
+struct index_builder {
+    struct index_pkg *pkgs;
+    size_t pkg_count;
+    size_t pkg_size;
+    struct table tables[INDEX_TABLE_MAX];
+    buffer_t strings;
+};
+
+struct index_builder *index_builder_new(void)
+{
+    struct index_builder *builder = calloc(1, sizeof(struct index_builder));
+    if (!builder)
+        return NULL;
+
+    if (buffer_init(&builder->strings, 4096) < 0) {
+        free(builder);
+        return NULL;
+    }
+
+    return builder;
+}
+
+void index_builder_free(struct index_builder *builder)
+{
+    size_t i;
+
+    if (!builder)
+        return;
+
+    for (i = 0; i < INDEX_TABLE_MAX; ++i)
+        free(builder->tables[i].entries);
+    free(builder->pkgs);
+    buffer_free(&builder->strings);
+    free(builder);
+}
+
+static int add_string(struct index_builder *builder, const char *str, size_t len,
+                      uint32_t *offset)
+{
+    size_t start = builder->strings.len;
+
+    /* offsets are 32 bits wide */
+    if (start + len + 1 > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    if (buffer_append(&builder->strings, str, len) < 0 ||
+        buffer_append(&builder->strings, "", 1) < 0)
+        return -1;
+
+    *offset = start;
+    return 0;
+}
+
+static int add_entry(struct index_builder *builder, enum index_table which,
+                     const char *key, size_t keylen, const char *text, size_t textlen)
+{
+    struct table *table = &builder->tables[which];
+    struct index_entry entry = { .pkg = builder->pkg_count - 1 };
+
+    if (table->count == table->size) {
+        size_t size = table->size ? table->size * 2 : 1024;
+        struct index_entry *entries = realloc(table->entries, size * sizeof(struct index_entry));
+        if (!entries)
+            return -1;
+
+        table->entries = entries;
+        table->size = size;
+    }
+
+    if (add_string(builder, key, keylen, &entry.key) < 0)
+        return -1;
+
+    if (textlen == keylen) {
+        entry.text = entry.key;
+    } else if (add_string(builder, text, textlen, &entry.text) < 0) {
+        return -1;
+    }
+
+    table->entries[table->count++] = entry;
+    return 0;
+}
+
+/* dependencies and provisions are searched by name alone */
+static int add_relation(struct index_builder *builder, enum index_table which, const char *text)
+{
+    size_t len = strlen(text);
+    size_t keylen = strcspn(text, "<>=:");
+
+    return add_entry(builder, which, text, keylen, text, len);
+}
+
+int index_add_package(struct index_builder *builder, const struct pkg *pkg)
+{
+    struct index_pkg entry;
+    const alpm_list_t *node;
+
+    if (builder->pkg_count == builder->pkg_size) {
+        size_t size = builder->pkg_size ? builder->pkg_size * 2 : 256;
+        struct index_pkg *pkgs = realloc(builder->pkgs, size * sizeof(struct index_pkg));
+        if (!pkgs)
+            return -1;
+
+        builder->pkgs = pkgs;
+        builder->pkg_size = size;
+    }
+
+    if (add_string(builder, pkg->name, strlen(pkg->name), &entry.name) < 0 ||
+        add_string(builder, pkg->version, strlen(pkg->version), &entry.version) < 0)
+        return -1;
+
+    builder->pkgs[builder->pkg_count++] = entry;
+
+    /* a package always provides itself */
+    if (add_relation(builder, INDEX_PROVIDES, pkg->name) < 0)
+        return -1;
+
+    for (node = pkg->provides; node; node = node->next) {
+        if (add_relation(builder, INDEX_PROVIDES, node->data) < 0)
+            return -1;
+    }
+
+    for (node = pkg->depends; node; node = node->next) {
+        if (add_relation(builder, INDEX_DEPENDS, node->data) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int index_add_files(struct index_builder *builder, const char *files, size_t len)
+{
+    const char *end = files + len;
+
+    if (!builder->pkg_count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (files < end) {
+        const char *eol = memchr(files, '\n', end - files);
+        size_t linelen = eol ? (size_t)(eol - files) : (size_t)(end - files);
+
+        /* skip the section header, the blank line ending it, and the
+         * directories, which every package shares */
+        if (linelen && files[0] != '%' && files[linelen - 1] != '/') {
+            if (add_entry(builder, INDEX_FILES, files, linelen, files, linelen) < 0)
+                return -1;
+        }
+
+        files += linelen + 1;
+    }
+
+    return 0;
+}
+
+static int entry_cmp(const void *p1, const void *p2, void *arg)
+{
+    const struct index_entry *e1 = p1, *e2 = p2;
+    const char *strings = arg;
+    int cmp = strcmp(&strings[e1->key], &strings[e2->key]);
+
+    if (cmp)
+        return cmp;
+    return e1->pkg < e2->pkg ? -1 : e1->pkg > e2->pkg;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+    const char *ptr = data;
+
+    while (len) {
+        ssize_t nbytes_w = write(fd, ptr, len);
+        if (nbytes_w < 0)
+            return -1;
+
+        ptr += nbytes_w;
+        len -= nbytes_w;
+    }
+
+    return 0;
+}
+
+int index_write(struct index_builder *builder, int dirfd, const char *name)
+{
+    _cleanup_free_ char *tmp = joinstring(name, ".tmp", NULL);
+    struct index_header header = {
+        .magic         = INDEX_MAGIC,
+        .version       = INDEX_VERSION,
+        .pkg_count     = builder->pkg_count,
+        .file_count    = builder->tables[INDEX_FILES].count,
+        .provide_count = builder->tables[INDEX_PROVIDES].count,
+        .depend_count  = builder->tables[INDEX_DEPENDS].count,
+        .strings_size  = builder->strings.len
+    };
+    uint64_t offset = sizeof(header);
+    size_t i;
+
+    header.pkgs = offset;
+    offset += builder->pkg_count * sizeof(struct index_pkg);
+    header.files = offset;
+    offset += header.file_count * sizeof(struct index_entry);
+    header.provides = offset;
+    offset += header.provide_count * sizeof(struct index_entry);
+    header.depends = offset;
+    offset += header.depend_count * sizeof(struct index_entry);
+    header.strings = offset;
+
+    for (i = 0; i < INDEX_TABLE_MAX; ++i) {
+        struct table *table = &builder->tables[i];
+        qsort_r(table->entries, table->count, sizeof(struct index_entry),
+                entry_cmp, builder->strings.data);
+    }
+
+    _cleanup_close_ int fd = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+
+    if (write_all(fd, &header, sizeof(header)) < 0 ||
+        write_all(fd, builder->pkgs, builder->pkg_count * sizeof(struct index_pkg)) < 0)
+        goto error;
+
+    for (i = 0; i < INDEX_TABLE_MAX; ++i) {
+        const struct table *table = &builder->tables[i];
+        if (write_all(fd, table->entries, table->count * sizeof(struct index_entry)) < 0)
+            goto error;
+    }
+
+    if (write_all(fd, builder->strings.data, builder->strings.len) < 0)
+        goto error;
+
+    if (renameat(dirfd, tmp, dirfd, name) < 0)
+        goto error;
+    return 0;
+
+error:
+    unlinkat(dirfd, tmp, 0);
+    return -1;
+}
+
+static bool within(const struct index *index, uint64_t offset, uint64_t count, size_t size)
+{
+    return offset <= index->size && count <= (index->size - offset) / size;
+}
+
+int index_open(struct index *index, int dirfd, const char *name)
+{
+    struct stat st;
+    _cleanup_close_ int fd = openat(dirfd, name, O_RDONLY);
+
+    *index = (struct index){ .data = MAP_FAILED };
+
+    if (fd < 0 || fstat(fd, &st) < 0)
+        return -1;
+
+    if ((size_t)st.st_size < sizeof(struct index_header)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    index->size = st.st_size;
+    index->data = mmap(NULL, index->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (index->data == MAP_FAILED)
+        return -1;
+
+    const struct index_header *header = index->header = (const void *)index->data;
+
+    /* check it's ours, and that nothing points outside of the file */
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != INDEX_VERSION ||
+        !within(index, header->pkgs, header->pkg_count, sizeof(struct index_pkg)) ||
+        !within(index, header->files, header->file_count, sizeof(struct index_entry)) ||
+        !within(index, header->provides, header->provide_count, sizeof(struct index_entry)) ||
+        !within(index, header->depends, header->depend_count, sizeof(struct index_entry)) ||
+        !within(index, header->strings, header->strings_size, 1) ||
+        (header->strings_size && index->data[header->strings + header->strings_size - 1] != '\0')) {
+        index_close(index);
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void index_close(struct index *index)
+{
+    if (index->data != MAP_FAILED)
+        munmap(index->data, index->size);
+    index->data = MAP_FAILED;
+}
+
+static const char *index_string(const struct index *index, uint32_t offset)
+{
+    if (offset >= index->header->strings_size)
+        return "";
+    return &index->data[index->header->strings + offset];
+}
+
+size_t index_query(const struct index *index, enum index_table table, const char *key, FILE *out)
+{
+    const struct index_header *header = index->header;
+    const struct index_pkg *pkgs = (const void *)&index->data[header->pkgs];
+    const struct index_entry *entries;
+    size_t lo = 0, hi, count, found = 0;
+
+    switch (table) {
+    case INDEX_FILES:
+        entries = (const void *)&index->data[header->files];
+        count = header->file_count;
+        /* paths are stored relative to / */
+        key += strspn(key, "/");
+        break;
+    case INDEX_PROVIDES:
+        entries = (const void *)&index->data[header->provides];
+        count = header->provide_count;
+        break;
+    case INDEX_DEPENDS:
+        entries = (const void *)&index->data[header->depends];
+        count = header->depend_count;
+        break;
+    default:
+        return 0;
+    }
+
+    /* find the first entry not less than the key */
+    hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (strcmp(index_string(index, entries[mid].key), key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (; lo < count; ++lo) {
+        const struct index_entry *entry = &entries[lo];
+
+        if (!streq(index_string(index, entry->key), key))
+            break;
+        if (entry->pkg >= header->pkg_count)
+            continue;
+
+        const struct index_pkg *pkg = &pkgs[entry->pkg];
+
+        fprintf(out, "%s %s", index_string(index, pkg->name), index_string(index, pkg->version));
+        if (entry->text != entry->key)
+            fprintf(out, " (%s)", index_string(index, entry->text));
+        fputc('\n', out);
+        ++found;
+    }
+
+    return found;
+}
@@ -0,0 +1,93 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct pkg;
+
+/* The query index is a single file meant to be mapped and searched in
+ * place. After a header come the packages, then three tables of entries
+ * each sorted by key (file paths, provided names and dependency names),
+ * and finally a pool of NUL terminated strings the rest points into.
+ * Everything is stored in the host's byte order. */
+#define INDEX_MAGIC   "REPOSEIX"
+#define INDEX_VERSION 1
+
+struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t pkg_count;
+    uint32_t file_count;
+    uint32_t provide_count;
+    uint32_t depend_count;
+    uint32_t strings_size;
+    uint64_t pkgs;
+    uint64_t files;
+    uint64_t provides;
+    uint64_t depends;
+    uint64_t strings;
+};
+
+struct index_pkg {
+    uint32_t name;
+    uint32_t version;
+};
+
+/* key is what's searched on: a path, or a name stripped of any version
+ * constraint. text is the entry as the package spelled it. */
+struct index_entry {
+    uint32_t key;
+    uint32_t text;
+    uint32_t pkg;
+};
+
+enum index_table {
+    INDEX_FILES,
+    INDEX_PROVIDES,
+    INDEX_DEPENDS,
+    INDEX_TABLE_MAX
+};
+
+struct index_builder;
+
+struct index_builder *index_builder_new(void);
+void index_builder_free(struct index_builder *builder);
+
+/* Packages are added in order, and each one's file list, the text of
+ * its %FILES% section, may follow. */
+int index_add_package(struct index_builder *builder, const struct pkg *pkg);
+int index_add_files(struct index_builder *builder, const char *files, size_t len);
+
+/* Write the index out under name, replacing any old one atomically. */
+int index_write(struct index_builder *builder, int dirfd, const char *name);
+
+struct index {
+    char *data;
+    size_t size;
+    const struct index_header *header;
+};
+
+int index_open(struct index *index, int dirfd, const char *name);
+void index_close(struct index *index);
+
+/* Print every match for key in the given table to out, one a line.
+ * Returns how many there were. */
+size_t index_query(const struct index *index, enum index_table table, const char *key, FILE *out);
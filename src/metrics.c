@@ -0,0 +1,143 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "stats.h"
+#include "util.h"
+
+static const struct {
+    enum counter hit;
+    enum counter miss;
+    const char *name;
+} caches[] = {
+    { COUNTER_CHECKSUM_HIT,  COUNTER_CHECKSUM_MISS,  "checksums" },
+    { COUNTER_SIGNATURE_HIT, COUNTER_SIGNATURE_MISS, "signatures" },
+    { COUNTER_FILES_HIT,     COUNTER_FILES_MISS,     "files" },
+};
+
+static void write_gauge(FILE *fp, const char *name, const char *help)
+{
+    fprintf(fp, "# HELP %s %s\n# TYPE %s gauge\n", name, help, name);
+}
+
+static void write_all(FILE *fp, const struct run_metrics *m)
+{
+    size_t i;
+
+    write_gauge(fp, "repose_last_run_timestamp_seconds", "When repose last finished.");
+    fprintf(fp, "repose_last_run_timestamp_seconds{repo=\"%s\"} %ld\n", m->repo, (long)time(NULL));
+
+    write_gauge(fp, "repose_packages", "Packages in the repository.");
+    fprintf(fp, "repose_packages{repo=\"%s\"} %zu\n", m->repo, m->packages);
+
+    write_gauge(fp, "repose_packages_changed", "Packages changed by the last run.");
+    fprintf(fp, "repose_packages_changed{repo=\"%s\",change=\"added\"} %lu\n", m->repo, m->added);
+    fprintf(fp, "repose_packages_changed{repo=\"%s\",change=\"updated\"} %lu\n", m->repo, m->updated);
+    fprintf(fp, "repose_packages_changed{repo=\"%s\",change=\"dropped\"} %lu\n", m->repo, m->dropped);
+
+    write_gauge(fp, "repose_database_written", "Whether the last run rewrote the databases.");
+    fprintf(fp, "repose_database_written{repo=\"%s\"} %d\n", m->repo, m->written);
+
+    if (m->written) {
+        write_gauge(fp, "repose_database_size_bytes", "Size of the written databases.");
+        fprintf(fp, "repose_database_size_bytes{repo=\"%s\",database=\"db\"} %jd\n",
+                m->repo, (intmax_t)m->db_size);
+        if (m->files_size)
+            fprintf(fp, "repose_database_size_bytes{repo=\"%s\",database=\"files\"} %jd\n",
+                    m->repo, (intmax_t)m->files_size);
+    }
+
+    write_gauge(fp, "repose_phase_duration_seconds", "Wall time spent in each phase of the last run.");
+    for (i = 0; i < PHASE_MAX; ++i)
+        fprintf(fp, "repose_phase_duration_seconds{repo=\"%s\",phase=\"%s\"} %.6f\n",
+                m->repo, stats_phase_name(i), stats_phase_seconds(m->stats, i));
+
+    write_gauge(fp, "repose_cache_hits", "Package metadata reused from the existing database.");
+    for (i = 0; i < sizeof(caches) / sizeof(caches[0]); ++i)
+        fprintf(fp, "repose_cache_hits{repo=\"%s\",cache=\"%s\"} %lu\n",
+                m->repo, caches[i].name, stats_counter(m->stats, caches[i].hit));
+
+    write_gauge(fp, "repose_cache_misses", "Package metadata recomputed from the pool.");
+    for (i = 0; i < sizeof(caches) / sizeof(caches[0]); ++i)
+        fprintf(fp, "repose_cache_misses{repo=\"%s\",cache=\"%s\"} %lu\n",
+                m->repo, caches[i].name, stats_counter(m->stats, caches[i].miss));
+}
+
+/* label values are quoted, so backslash, double quote and newline
+ * have to be escaped as the text format expects */
+static char *escape_label(const char *value)
+{
+    char *escaped = malloc(strlen(value) * 2 + 1), *p = escaped;
+    if (!escaped)
+        return NULL;
+
+    for (; *value; ++value) {
+        switch (*value) {
+        case '\\':
+            *p++ = '\\';
+            *p++ = '\\';
+            break;
+        case '"':
+            *p++ = '\\';
+            *p++ = '"';
+            break;
+        case '\n':
+            *p++ = '\\';
+            *p++ = 'n';
+            break;
+        default:
+            *p++ = *value;
+        }
+    }
+
+    *p = '\0';
+    return escaped;
+}
+
+/* the textfile collector may read at any time, so never let it see a
+ * partially written file */
+int write_metrics(const char *path, const struct run_metrics *metrics)
+{
+    struct run_metrics escaped = *metrics;
+    _cleanup_free_ char *repo = escape_label(metrics->repo);
+    if (!repo)
+        return -errno;
+    escaped.repo = repo;
+
+    _cleanup_free_ char *tmp = joinstring(path, ".tmp", NULL);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp)
+        return -errno;
+
+    write_all(fp, &escaped);
+
+    if (fclose(fp) != 0 || rename(tmp, path) < 0) {
+        int saved = errno;
+        remove(tmp);
+        return -saved;
+    }
+
+    return 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct stats;
+
+struct run_metrics {
+    const char *repo;
+    size_t packages;
+    unsigned long added;
+    unsigned long updated;
+    unsigned long dropped;
+    bool written;
+    off_t db_size;
+    off_t files_size;
+    const struct stats *stats;
+};
+
+int write_metrics(const char *path, const struct run_metrics *metrics);
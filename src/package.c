@@ -21,7 +21,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <limits.h>
-#include <err.h>
+#include <errno.h>
 #include <archive.h>
 #include <archive_entry.h>
 #include <unistd.h>
@@ -32,53 +32,43 @@
 #include "reader.h"
 #include "pkghash.h"
 #include "base64.h"
+#include "fields.h"
+#include "signing.h"
 
 static void pkginfo_assignment(const char *key, const char *value, pkg_t *pkg)
 {
-    if (streq(key, "pkgname"))
-        pkg->name = strdup(value);
-    else if (streq(key, "pkgbase"))
-        pkg->base = strdup(value);
-    else if (streq(key, "pkgver"))
-        pkg->version = strdup(value);
-    else if (streq(key, "pkgdesc"))
-        pkg->desc = strdup(value);
-    else if (streq(key, "url"))
-        pkg->url = strdup(value);
-    else if (streq(key, "builddate"))
-        pkg->builddate = atol(value);
-    else if (streq(key, "packager"))
-        pkg->packager = strdup(value);
-    else if (streq(key, "size"))
-        pkg->isize = atol(value);
-    else if (streq(key, "arch"))
-        pkg->arch = strdup(value);
-    else if (streq(key, "group"))
-        pkg->groups = alpm_list_add(pkg->groups, strdup(value));
-    else if (streq(key, "license"))
-        pkg->licenses = alpm_list_add(pkg->licenses, strdup(value));
-    else if (streq(key, "replaces"))
-        pkg->replaces = alpm_list_add(pkg->replaces, strdup(value));
-    else if (streq(key, "depend"))
-        pkg->depends = alpm_list_add(pkg->depends, strdup(value));
-    else if (streq(key, "conflict"))
-        pkg->conflicts = alpm_list_add(pkg->conflicts, strdup(value));
-    else if (streq(key, "provides"))
-        pkg->provides = alpm_list_add(pkg->provides, strdup(value));
-    else if (streq(key, "optdepend"))
-        pkg->optdepends = alpm_list_add(pkg->optdepends, strdup(value));
-    else if (streq(key, "makedepend"))
-        pkg->makedepends = alpm_list_add(pkg->makedepends, strdup(value));
-    else if (streq(key, "checkdepend"))
-        pkg->checkdepends = alpm_list_add(pkg->checkdepends, strdup(value));
+    const struct field *field = pkginfo_field(key, strlen(key));
+    if (!field)
+        return;
+
+    switch (field->type) {
+    case FIELD_STRING:
+        *field_string(pkg, field) = strdup(value);
+        break;
+    case FIELD_LIST:
+        *field_list(pkg, field) = alpm_list_add(*field_list(pkg, field), strdup(value));
+        break;
+    case FIELD_SIZE:
+        *field_size(pkg, field) = atol(value);
+        break;
+    case FIELD_TIME:
+        *field_time(pkg, field) = atol(value);
+        break;
+    case FIELD_FILES:
+    case FIELD_MATCH:
+        break;
+    }
 }
 
-static void read_pkginfo(struct archive *archive, pkg_t *pkg)
+int read_pkginfo(struct archive *archive, pkg_t *pkg)
 {
     _cleanup_free_ struct archive_reader *reader = archive_reader_new(archive);
     ssize_t nbytes_r = 0;
     char line[LINE_MAX];
 
+    if (!reader)
+        return -1;
+
     for (;;) {
         nbytes_r = archive_fgets(reader, line, sizeof(line));
         if (nbytes_r < 0)
@@ -92,40 +82,39 @@ static void read_pkginfo(struct archive *archive, pkg_t *pkg)
 
         line[nbytes_r] = '\0';
         char *e = memchr(line, '=', nbytes_r);
-        if (!e)
-            err(EXIT_FAILURE, "failed to find '='");
+        if (!e) {
+            errno = EINVAL;
+            return -1;
+        }
 
         *e++ = 0;
         pkginfo_assignment(strstrip(line), strstrip(e), pkg);
     }
+
+    return 0;
 }
 
-int load_package(pkg_t *pkg, int fd)
+int load_package_file(pkg_t *pkg, const struct file_t *file)
 {
     struct archive *archive;
-    struct file_t file;
-
-    if (file_from_fd(&file, fd) < 0) {
-        return -1;
-    }
 
     archive = archive_read_new();
     archive_read_support_filter_all(archive);
     archive_read_support_format_all(archive);
 
-    if (archive_read_open_memory(archive, file.mmap, file.st.st_size) != ARCHIVE_OK) {
+    if (archive_read_open_memory(archive, file->mmap, file->st.st_size) != ARCHIVE_OK) {
         archive_read_free(archive);
         return -1;
     }
 
-    bool found_pkginfo = false;
+    bool found_pkginfo = false, valid = true;
     struct archive_entry *entry;
     while (archive_read_next_header(archive, &entry) == ARCHIVE_OK && !found_pkginfo) {
         const char *entry_name = archive_entry_pathname(entry);
         const mode_t mode = archive_entry_mode(entry);
 
         if (S_ISREG(mode) && streq(entry_name, ".PKGINFO")) {
-            read_pkginfo(archive, pkg);
+            valid = read_pkginfo(archive, pkg) == 0;
             found_pkginfo = true;
         }
     }
@@ -133,9 +122,10 @@ int load_package(pkg_t *pkg, int fd)
     archive_read_close(archive);
     archive_read_free(archive);
 
-    if (found_pkginfo) {
-        pkg->size = file.st.st_size;
-        pkg->mtime = file.st.st_mtime;
+    /* a package without a version is no use to us either */
+    if (found_pkginfo && valid && pkg->version && version_parse(&pkg->version_key, pkg->version) == 0) {
+        pkg->size = file->st.st_size;
+        pkg->mtime = file->st.st_mtime;
         pkg->name_hash = _alpm_hash_sdbm(pkg->name);
         return 0;
     }
@@ -143,10 +133,25 @@ int load_package(pkg_t *pkg, int fd)
     return -1;
 }
 
+int load_package(pkg_t *pkg, int fd)
+{
+    struct file_t file;
+
+    /* don't stall on the whole package, parsing can start as soon as
+     * the first pages are in */
+    if (file_map(&file, fd) < 0) {
+        return -1;
+    }
+
+    int ret = load_package_file(pkg, &file);
+    file_unmap(&file);
+    return ret;
+}
+
 int load_package_signature(struct pkg *pkg, int dirfd)
 {
     struct file_t file;
-    _cleanup_free_ char *signame = joinstring(pkg->filename, ".sig", NULL);
+    _cleanup_free_ char *signame = joinstring(pkg->path, ".sig", NULL);
     _cleanup_close_ int fd = openat(dirfd, signame, O_RDONLY);
 
     if (fd < 0)
@@ -161,7 +166,38 @@ int load_package_signature(struct pkg *pkg, int dirfd)
     if (file.st.st_mtime > pkg->mtime)
         file.st.st_mtime = pkg->mtime;
 
-    file_close(&file);
+    file_unmap(&file);
+    return 0;
+}
+
+/* Fill in whatever checksums are missing and, given a signer, sign a
+ * package that has no signature, all off one read of the package. */
+int package_digest(struct pkg *pkg, int dirfd, struct signer *signer)
+{
+    struct file_t file;
+    _cleanup_close_ int fd = openat(dirfd, pkg->path, O_RDONLY);
+
+    if (fd < 0)
+        return -1;
+
+    if (file_from_fd(&file, fd) < 0)
+        return -1;
+
+    if (!pkg->md5sum)
+        pkg->md5sum = md5_memory(file.mmap, file.st.st_size);
+    if (!pkg->sha256sum)
+        pkg->sha256sum = sha256_memory(file.mmap, file.st.st_size);
+
+    if (signer && !pkg->base64sig) {
+        size_t len;
+        _cleanup_free_ unsigned char *sig = signer_sign_memory(signer, file.mmap,
+                                                               file.st.st_size, &len);
+
+        if (sig)
+            base64_encode((unsigned char **)&pkg->base64sig, sig, len);
+    }
+
+    file_unmap(&file);
     return 0;
 }
 
@@ -184,7 +220,7 @@ static bool is_package_metadata(const char *entry_name) {
   return false;
 }
 
-int load_package_files(struct pkg *pkg, int fd)
+int load_package_files(struct pkg *pkg, int fd, struct dirtable *dirs)
 {
     struct archive *archive;
     struct file_t file;
@@ -198,27 +234,34 @@ int load_package_files(struct pkg *pkg, int fd)
 
     if (archive_read_open_memory(archive, file.mmap, file.st.st_size) != ARCHIVE_OK) {
         archive_read_free(archive);
+        file_unmap(&file);
         return -1;
     }
 
     struct archive_entry *entry;
-    while (archive_read_next_header(archive, &entry) == ARCHIVE_OK) {
+    int ret = 0;
+    while (ret == 0 && archive_read_next_header(archive, &entry) == ARCHIVE_OK) {
         const char *entry_name = archive_entry_pathname(entry);
 
         if (!is_package_metadata(entry_name))
-            pkg->files = alpm_list_add(pkg->files, strdup(entry_name));
+            ret = filelist_add(&pkg->files, dirs, entry_name, strlen(entry_name));
     }
 
     archive_read_close(archive);
     archive_read_free(archive);
-    return 0;
+    file_unmap(&file);
+
+    filelist_compact(&pkg->files);
+    return ret;
 }
 
 void package_free(pkg_t *pkg)
 {
     free(pkg->filename);
+    free(pkg->path);
     free(pkg->name);
     free(pkg->version);
+    version_free(&pkg->version_key);
     free(pkg->desc);
     free(pkg->url);
     free(pkg->packager);
@@ -241,8 +284,7 @@ void package_free(pkg_t *pkg)
     alpm_list_free(pkg->optdepends);
     alpm_list_free_inner(pkg->makedepends, free);
     alpm_list_free(pkg->makedepends);
-    alpm_list_free_inner(pkg->files, free);
-    alpm_list_free(pkg->files);
+    filelist_free(&pkg->files);
 
     free(pkg);
 }
@@ -20,14 +20,25 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <time.h>
+#include <sys/types.h>
+#include <archive.h>
 #include <alpm_list.h>
+#include "vercmp.h"
+#include "filelist.h"
+
+struct pool;
+struct signer;
+struct file_t;
 
 typedef struct pkg {
     unsigned long name_hash;
     char *filename;
+    char *path;
+    const struct pool *pool;
     char *name;
     char *base;
     char *version;
+    struct version version_key;
     char *desc;
     char *url;
     char *packager;
@@ -49,10 +60,17 @@ typedef struct pkg {
     alpm_list_t *optdepends;
     alpm_list_t *makedepends;
     alpm_list_t *checkdepends;
-    alpm_list_t *files;
+    struct filelist files;
+
+    /* the raw files entry from the old database, when spooled */
+    off_t files_offset;
+    size_t files_size;
 } pkg_t;
 
+int read_pkginfo(struct archive *archive, pkg_t *pkg);
 int load_package(pkg_t *pkg, int fd);
+int load_package_file(pkg_t *pkg, const struct file_t *file);
 int load_package_signature(struct pkg *pkg, int fd);
-int load_package_files(pkg_t *pkg, int fd);
+int load_package_files(pkg_t *pkg, int fd, struct dirtable *dirs);
+int package_digest(struct pkg *pkg, int dirfd, struct signer *signer);
 void package_free(pkg_t *pkg);
@@ -234,6 +234,12 @@ alpm_pkghash_t *_alpm_pkghash_add_sorted(alpm_pkghash_t *hash, struct pkg *pkg)
 	return pkghash_add_pkg(hash, pkg, 1);
 }
 
+/* sorting relinks the existing list nodes, so the buckets stay valid */
+void _alpm_pkghash_sort(alpm_pkghash_t *hash)
+{
+	hash->list = alpm_list_msort(hash->list, hash->entries, _alpm_pkg_cmp);
+}
+
 static unsigned int move_one_entry(alpm_pkghash_t *hash,
 		unsigned int start, unsigned int end)
 {
@@ -55,6 +55,7 @@ alpm_pkghash_t *_alpm_pkghash_add(alpm_pkghash_t *hash, struct pkg *pkg);
 alpm_pkghash_t *_alpm_pkghash_add_sorted(alpm_pkghash_t *hash, struct pkg *pkg);
 alpm_pkghash_t *_alpm_pkghash_remove(alpm_pkghash_t *hash, struct pkg *pkg, struct pkg **data);
 
+void _alpm_pkghash_sort(alpm_pkghash_t *hash);
 void _alpm_pkghash_free(alpm_pkghash_t *hash);
 
 struct pkg *_alpm_pkghash_find(alpm_pkghash_t *hash, const char *name);
@@ -0,0 +1,1057 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#include "repo.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <err.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <archive.h>
+#include <sys/stat.h>
+
+#include "database.h"
+#include "package.h"
+#include "util.h"
+#include "strmap.h"
+#include "signing.h"
+#include "stats.h"
+#include "index.h"
+
+static inline _printf_(2,3) void trace(const struct repo *repo, const char *fmt, ...)
+{
+    if (repo->verbose) {
+        va_list ap;
+
+        va_start(ap, fmt);
+        vprintf(fmt, ap);
+        va_end(ap);
+    }
+}
+
+static inline int make_link(const struct pkg *pkg, int dirfd)
+{
+    _cleanup_free_ char *link = joinstring(pkg->pool->path, "/", pkg->path, NULL);
+    return symlinkat(link, dirfd, pkg->filename);
+}
+
+static inline int compat_link(int rootdb, const char *reponame, int compression)
+{
+    static const char *ext[] = {
+        [ARCHIVE_FILTER_NONE]     = "",
+        [ARCHIVE_FILTER_BZIP2]    = ".bz2",
+        [ARCHIVE_FILTER_XZ]       = ".xz",
+        [ARCHIVE_FILTER_GZIP]     = ".gz",
+        [ARCHIVE_FILTER_COMPRESS] = ".Z"
+    };
+
+    _cleanup_free_ char *link = joinstring(reponame, ".tar", ext[compression], NULL);
+    return symlinkat(reponame, rootdb, link);
+}
+
+static int open_db(struct repo *repo, const char *name)
+{
+    int fd = openat(repo->rootfd, name, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0) {
+        warn("failed to open %s for writing", name);
+        return -1;
+    }
+
+    trace(repo, "writing %s...\n", name);
+    return fd;
+}
+
+static void finish_db(struct repo *repo, const char *name)
+{
+    if (repo->compat && compat_link(repo->rootfd, name, repo->compression) < 0) {
+        if (errno != EEXIST)
+            warn("failed to make compatability symlink to %s", name);
+    }
+}
+
+static int write_index(struct repo *repo, struct index_builder *index)
+{
+    trace(repo, "writing %s...\n", repo->indexname);
+    if (index_write(index, repo->rootfd, repo->indexname) < 0) {
+        warn("failed to write %s", repo->indexname);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int save_repo(struct repo *repo, const struct db_output *outputs, size_t count)
+{
+    const struct db_options options = {
+        .compression = repo->compression,
+        .rsyncable   = repo->rsyncable,
+        .epoch       = repo->epoch,
+        .spoolfd     = repo->spoolfd,
+        .dirs        = &repo->dirs,
+        .index       = repo->index ? index_builder_new() : NULL
+    };
+
+    int ret = -1;
+
+    if (repo->index && !options.index)
+        warn("failed to allocate memory");
+    else if (save_database(outputs, count, repo->cache, &options) < 0)
+        warnx("failed to write %s", repo->dbname);
+    else if (!options.index || write_index(repo, options.index) == 0)
+        ret = 0;
+
+    if (options.index)
+        index_builder_free(options.index);
+    return ret;
+}
+
+/* Both databases are written in one pass over the cache, each
+ * compressed on its own thread. */
+static int render_db(struct repo *repo)
+{
+    struct db_output outputs[2];
+    size_t i, count = 0;
+    bool opened = true;
+    int ret = -1;
+
+    outputs[count++] = (struct db_output){ open_db(repo, repo->dbname), DB_DESC | DB_DEPENDS };
+    if (repo->filesname)
+        outputs[count++] = (struct db_output){ open_db(repo, repo->filesname), DB_FILES };
+
+    for (i = 0; i < count; ++i)
+        opened = opened && outputs[i].fd >= 0;
+
+    if (opened) {
+        stats_begin(PHASE_FORMAT);
+        ret = save_repo(repo, outputs, count);
+        stats_end(PHASE_FORMAT);
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (outputs[i].fd >= 0)
+            close(outputs[i].fd);
+    }
+
+    if (ret < 0)
+        return -1;
+
+    finish_db(repo, repo->dbname);
+    if (repo->filesname)
+        finish_db(repo, repo->filesname);
+
+    /* both signatures are made at once, each on its own context */
+    if (repo->sign) {
+        const char *names[] = { repo->dbname, repo->filesname };
+
+        stats_begin(PHASE_SIGN);
+        ret = signer_sign_files(repo->signer, repo->rootfd, names, repo->filesname ? 2 : 1);
+        stats_end(PHASE_SIGN);
+    }
+
+    return ret;
+}
+
+static inline int delete_link(const struct pkg *pkg, int dirfd)
+{
+    struct stat buf;
+    if (fstatat(dirfd, pkg->filename, &buf, AT_SYMLINK_NOFOLLOW) < 0)
+        return errno != ENOENT ? -1 : 0;
+
+    if (S_ISLNK(buf.st_mode))
+        return unlinkat(dirfd, pkg->filename, 0);
+    return 0;
+}
+
+static inline bool needs_link(const struct pkg *pkg)
+{
+    return pkg->pool && !pkg->pool->root;
+}
+
+static int relink(const struct pkg *pkg, int dirfd)
+{
+    if (make_link(pkg, dirfd) == 0)
+        return 0;
+    if (errno != EEXIST)
+        return -1;
+
+    /* whatever link holds the name is stale, the package is new */
+    if (delete_link(pkg, dirfd) < 0)
+        return -1;
+    return make_link(pkg, dirfd);
+}
+
+/* Only packages that were added or replaced need touching; everything
+ * else already has its link from an earlier run. */
+static void link_db(struct repo *repo)
+{
+    alpm_list_t *node;
+
+    for (node = repo->unlinked; node; node = node->next) {
+        const struct pkg *pkg = node->data;
+
+        if (relink(pkg, repo->rootfd) < 0)
+            warn("failed to link %s", pkg->filename);
+    }
+
+    alpm_list_free(repo->unlinked);
+    repo->unlinked = NULL;
+}
+
+/* Take a package out for good: its link goes, and so does any link
+ * still waiting to be made for it. The caller has already removed it
+ * from the cache. */
+static void forget_package(struct repo *repo, struct pkg *pkg)
+{
+    alpm_list_t *node;
+
+    for (node = repo->unlinked; node; node = node->next) {
+        if (node->data == pkg) {
+            repo->unlinked = alpm_list_remove_item(repo->unlinked, node);
+            free(node);
+            break;
+        }
+    }
+
+    delete_link(pkg, repo->rootfd);
+    package_free(pkg);
+}
+
+struct link_slot {
+    const struct pkg *pkg;
+    bool seen;
+};
+
+static bool link_matches(const struct pkg *pkg, int dirfd, const char *name)
+{
+    _cleanup_free_ char *want = joinstring(pkg->pool->path, "/", pkg->path, NULL);
+    char target[PATH_MAX];
+
+    ssize_t len = readlinkat(dirfd, name, target, sizeof(target) - 1);
+    if (len < 0)
+        return false;
+
+    target[len] = 0;
+    return streq(target, want);
+}
+
+/* Reconcile the root against the cache in one pass over the directory:
+ * stale and wrong links are removed, missing ones made. */
+static int verify_links(struct repo *repo)
+{
+    alpm_list_t *node;
+    size_t i, count = 0;
+    unsigned long made = 0, fixed = 0, removed = 0;
+
+    struct link_slot *slots = calloc(repo->cache->entries, sizeof(struct link_slot));
+    struct strmap *wanted = strmap_new(repo->cache->entries);
+    if ((repo->cache->entries && !slots) || !wanted) {
+        warn("failed to allocate memory");
+        strmap_free(wanted);
+        free(slots);
+        return -1;
+    }
+
+    /* packages that aren't linked still claim their name, so that
+     * whatever holds it is left alone */
+    for (node = repo->cache->list; node; node = node->next) {
+        const struct pkg *pkg = node->data;
+
+        slots[count] = (struct link_slot){ .pkg = pkg };
+        strmap_insert(wanted, pkg->filename, &slots[count++]);
+    }
+
+    _cleanup_closedir_ DIR *dirp = fdopendir(dup(repo->rootfd));
+    const struct dirent *dp;
+
+    if (!dirp) {
+        warn("fdopendir failed");
+        strmap_free(wanted);
+        free(slots);
+        return -1;
+    }
+    rewinddir(dirp);
+
+    while ((dp = readdir(dirp))) {
+        unsigned char type = dp->d_type;
+
+        if (!is_package(dp->d_name))
+            continue;
+
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+
+            if (fstatat(repo->rootfd, dp->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                continue;
+            if (S_ISLNK(st.st_mode))
+                type = DT_LNK;
+        }
+
+        /* only ever touch symlinks, never real packages */
+        if (type != DT_LNK)
+            continue;
+
+        struct link_slot *slot = strmap_find(wanted, dp->d_name);
+        if (!slot) {
+            trace(repo, "removing stale link %s\n", dp->d_name);
+            if (unlinkat(repo->rootfd, dp->d_name, 0) < 0)
+                warn("failed to remove %s", dp->d_name);
+            removed++;
+            continue;
+        }
+
+        slot->seen = true;
+        if (!needs_link(slot->pkg) || link_matches(slot->pkg, repo->rootfd, dp->d_name))
+            continue;
+
+        trace(repo, "fixing link %s\n", dp->d_name);
+        if (unlinkat(repo->rootfd, dp->d_name, 0) < 0 || make_link(slot->pkg, repo->rootfd) < 0)
+            warn("failed to relink %s", dp->d_name);
+        fixed++;
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (slots[i].seen || !needs_link(slots[i].pkg))
+            continue;
+
+        trace(repo, "linking %s\n", slots[i].pkg->filename);
+        if (relink(slots[i].pkg, repo->rootfd) < 0)
+            warn("failed to link %s", slots[i].pkg->filename);
+        made++;
+    }
+
+    trace(repo, "links: %lu made, %lu fixed, %lu removed\n", made, fixed, removed);
+
+    strmap_free(wanted);
+    free(slots);
+    return 0;
+}
+
+static inline alpm_pkghash_t *_alpm_pkghash_replace(alpm_pkghash_t *cache, struct pkg *new,
+                                                    struct pkg *old)
+{
+    cache = _alpm_pkghash_remove(cache, old, NULL);
+    return _alpm_pkghash_add(cache, new);
+}
+
+static void reduce_repo(struct repo *repo)
+{
+    alpm_list_t *node, *next;
+
+    for (node = repo->cache->list; node; node = next) {
+        struct pkg *pkg = node->data;
+        const struct pool_file *file = filecache_find(&repo->filecache, pkg->filename);
+
+        next = node->next;
+
+        if (file) {
+            if (!pkg->pool) {
+                pkg->pool = file->pool;
+                pkg->path = strdup(file->path);
+            }
+        } else {
+            trace(repo, "dropping %s\n", pkg->name);
+
+            repo->cache = _alpm_pkghash_remove(repo->cache, pkg, NULL);
+            forget_package(repo, pkg);
+            repo->state = REPO_DIRTY;
+            repo->changes.dropped++;
+        }
+    }
+}
+
+enum change_kind {
+    CHANGE_ADD,
+    CHANGE_VERSION,
+    CHANGE_TIMESTAMP,
+    CHANGE_BUILD,
+    CHANGE_SIGNATURE
+};
+
+struct change {
+    struct pkg *pkg;
+    struct pkg *old;
+    enum change_kind kind;
+};
+
+static bool has_signature(const struct pkg *pkg)
+{
+    _cleanup_free_ char *signame = joinstring(pkg->path, ".sig", NULL);
+    return faccessat(pkg->pool->fd, signame, F_OK, 0) == 0;
+}
+
+/* Check every incoming package's signature at once, across a pool of
+ * contexts, and strike the ones that fail from the change set. When
+ * packages are being signed, one that came without a signature isn't
+ * rejected, it's about to get one. */
+static int verify_changes(struct repo *repo, struct change *changes, size_t count)
+{
+    struct signed_file *files = calloc(count, sizeof(struct signed_file));
+    size_t i;
+
+    if (count && !files)
+        return -1;
+
+    for (i = 0; i < count; ++i) {
+        files[i] = (struct signed_file){
+            .dirfd = changes[i].pkg->pool->fd,
+            .path  = changes[i].pkg->path
+        };
+    }
+
+    stats_begin(PHASE_SIGNATURES);
+    signer_verify_each(repo->signer, files, count);
+    stats_end(PHASE_SIGNATURES);
+
+    for (i = 0; i < count; ++i) {
+        if (files[i].result == 0)
+            continue;
+        if (repo->sign_packages && !has_signature(changes[i].pkg))
+            continue;
+
+        warnx("rejecting %s: signature check failed", changes[i].pkg->filename);
+        changes[i].pkg = NULL;
+    }
+
+    free(files);
+    return 0;
+}
+
+struct package_batch {
+    struct signer *signer;
+    struct pkg **pkgs;
+    size_t count;
+    atomic_size_t next;
+};
+
+static void *sign_worker(void *arg)
+{
+    struct package_batch *batch = arg;
+
+    for (;;) {
+        size_t i = atomic_fetch_add(&batch->next, 1);
+        if (i >= batch->count)
+            break;
+
+        struct pkg *pkg = batch->pkgs[i];
+        if (package_digest(pkg, pkg->pool->fd, batch->signer) < 0)
+            warn("failed to read %s", pkg->path);
+        else if (!pkg->base64sig)
+            warnx("failed to sign %s", pkg->filename);
+    }
+
+    return NULL;
+}
+
+/* Sign the incoming packages that came without a signature, all at
+ * once across the signer's contexts. Each is read just the once, for
+ * its checksums as well. */
+static int sign_changes(struct repo *repo, const struct change *changes, size_t count)
+{
+    struct package_batch batch = { .signer = repo->signer };
+    size_t i;
+
+    batch.pkgs = calloc(count, sizeof(struct pkg *));
+    if (count && !batch.pkgs)
+        return -1;
+
+    stats_begin(PHASE_SIGNATURES);
+    for (i = 0; i < count; ++i) {
+        struct pkg *pkg = changes[i].pkg;
+
+        if (!pkg || !pkg->pool)
+            continue;
+        if (!pkg->base64sig && load_package_signature(pkg, pkg->pool->fd) < 0)
+            batch.pkgs[batch.count++] = pkg;
+    }
+    stats_end(PHASE_SIGNATURES);
+
+    if (batch.count) {
+        stats_begin(PHASE_HASH);
+        run_parallel(batch.count < nr_workers() ? batch.count : nr_workers(),
+                     sign_worker, &batch);
+        stats_end(PHASE_HASH);
+    }
+
+    free(batch.pkgs);
+    return 0;
+}
+
+/* Whatever of src didn't make it into the cache has no other owner. */
+static void discard_incoming(struct repo *repo, alpm_pkghash_t *src)
+{
+    alpm_list_t *node;
+
+    for (node = src->list; node; node = node->next) {
+        struct pkg *pkg = node->data;
+
+        if (_alpm_pkghash_find(repo->cache, pkg->name) != pkg)
+            package_free(pkg);
+    }
+
+    _alpm_pkghash_free(src);
+}
+
+/* Packages in src that make the cut are moved into the pool into, if
+ * given; anything rejected is left where it was. */
+static int update_repo(struct repo *repo, alpm_pkghash_t *src, const struct pool *into)
+{
+    alpm_list_t *node;
+    size_t i, count = 0;
+
+    struct change *changes = calloc(src->entries, sizeof(struct change));
+    if (src->entries && !changes) {
+        warn("failed to allocate memory");
+        discard_incoming(repo, src);
+        return -1;
+    }
+
+    /* work out what changes before touching the cache, so that incoming
+     * packages can be vetted as a batch */
+    for (node = src->list; node; node = node->next) {
+        struct pkg *pkg = node->data;
+        struct pkg *old = _alpm_pkghash_find(repo->cache, pkg->name);
+        enum change_kind kind = CHANGE_VERSION;
+        bool replace = false;
+        int vercmp;
+
+        /* if the package isn't in the cache, add it */
+        if (!old) {
+            changes[count++] = (struct change){ pkg, NULL, CHANGE_ADD };
+            continue;
+        }
+
+        vercmp = version_cmp(&pkg->version_key, &old->version_key);
+
+        switch(vercmp) {
+            case 1:
+                replace = true;
+                break;
+            case 0:
+                if (pkg->mtime > old->mtime) {
+                    kind = CHANGE_TIMESTAMP;
+                    replace = true;
+                } else if (pkg->builddate > old->builddate) {
+                    kind = CHANGE_BUILD;
+                    replace = true;
+                } else if (old->base64sig == NULL && pkg->base64sig) {
+                    kind = CHANGE_SIGNATURE;
+                    replace = true;
+                }
+                break;
+            case -1:
+                break;
+        }
+
+        if (replace)
+            changes[count++] = (struct change){ pkg, old, kind };
+    }
+
+    if (repo->verify_packages && verify_changes(repo, changes, count) < 0) {
+        warn("failed to allocate memory");
+        free(changes);
+        discard_incoming(repo, src);
+        return -1;
+    }
+
+    if (repo->sign_packages && sign_changes(repo, changes, count) < 0) {
+        warn("failed to allocate memory");
+        free(changes);
+        discard_incoming(repo, src);
+        return -1;
+    }
+
+    for (i = 0; i < count; ++i) {
+        struct pkg *pkg = changes[i].pkg, *old = changes[i].old;
+
+        if (!pkg)
+            continue;
+
+        if (into && ingest_move(pkg, into) < 0)
+            continue;
+
+        if (needs_link(pkg))
+            repo->unlinked = alpm_list_add(repo->unlinked, pkg);
+
+        /* only now is the change certain to happen */
+        switch (changes[i].kind) {
+            case CHANGE_ADD:
+                trace(repo, "adding %s %s\n", pkg->name, pkg->version);
+                break;
+            case CHANGE_VERSION:
+                trace(repo, "updating %s %s => %s\n", pkg->name, old->version, pkg->version);
+                break;
+            case CHANGE_TIMESTAMP:
+                trace(repo, "updating %s %s [newer timestamp]\n", pkg->name, pkg->version);
+                break;
+            case CHANGE_BUILD:
+                trace(repo, "updating %s %s [newer build]\n", pkg->name, pkg->version);
+                break;
+            case CHANGE_SIGNATURE:
+                trace(repo, "adding signature for %s\n", pkg->name);
+                break;
+        }
+
+        if (old) {
+            repo->cache = _alpm_pkghash_replace(repo->cache, pkg, old);
+            forget_package(repo, old);
+            repo->changes.updated++;
+        } else {
+            repo->cache = _alpm_pkghash_add(repo->cache, pkg);
+            repo->changes.added++;
+        }
+
+        repo->state = REPO_DIRTY;
+    }
+
+    free(changes);
+    discard_incoming(repo, src);
+    return 0;
+}
+
+int repo_scan(struct repo *repo)
+{
+    stats_attach(repo->stats);
+
+    filecache_free(&repo->filecache);
+    repo->filecache = (struct filecache){ 0 };
+
+    stats_begin(PHASE_ENUMERATE);
+    int ret = filecache_scan(&repo->filecache, repo->pools, repo->pool_count);
+    stats_end(PHASE_ENUMERATE);
+
+    if (ret < 0)
+        warn("failed to scan pool");
+    return ret;
+}
+
+int repo_sync(struct repo *repo, const struct targets *targets, const char *arch)
+{
+    stats_attach(repo->stats);
+
+    if (repo_scan(repo) < 0)
+        return -1;
+
+    if (repo->dedup) {
+        stats_begin(PHASE_HASH);
+        int ret = filecache_dedup(&repo->filecache, repo->cache, repo->dedup_mode,
+                                  &repo->deduped);
+        stats_end(PHASE_HASH);
+
+        if (ret < 0) {
+            warn("failed to deduplicate pool");
+            return -1;
+        }
+    }
+
+    stats_begin(PHASE_PARSE);
+    alpm_pkghash_t *pkgcache = get_filecache(&repo->filecache, targets, arch);
+    stats_end(PHASE_PARSE);
+
+    if (!pkgcache) {
+        warn("failed to get filecache");
+        return -1;
+    }
+
+    reduce_repo(repo);
+    return update_repo(repo, pkgcache, NULL);
+}
+
+/* incoming packages are read once, here, and only moved into the first
+ * pool once they're accepted */
+int repo_add(struct repo *repo, const char *incoming, const struct targets *targets,
+             const char *arch)
+{
+    stats_attach(repo->stats);
+
+    _cleanup_close_ int dirfd = open(incoming, O_RDONLY | O_DIRECTORY);
+    if (dirfd < 0) {
+        warn("failed to open incoming directory %s", incoming);
+        return -1;
+    }
+
+    alpm_pkghash_t *empty = _alpm_pkghash_create(100);
+    if (!empty) {
+        warn("failed to allocate memory");
+        return -1;
+    }
+
+    stats_begin(PHASE_PARSE);
+    const struct pool pool = { .path = incoming, .fd = dirfd };
+    alpm_pkghash_t *pkgcache = ingest_packages(empty, dirfd, &pool, targets, arch);
+    stats_end(PHASE_PARSE);
+
+    if (!pkgcache) {
+        warn("failed to ingest %s", incoming);
+        _alpm_pkghash_free(empty);
+        return -1;
+    }
+
+    return update_repo(repo, pkgcache, &repo->pools[0]);
+}
+
+int repo_drop(struct repo *repo, const struct targets *targets)
+{
+    alpm_list_t *node, *next;
+
+    stats_attach(repo->stats);
+
+    if (!targets)
+        return 0;
+
+    for (node = repo->cache->list; node; node = next) {
+        struct pkg *pkg = node->data;
+
+        next = node->next;
+
+        if (match_targets(targets, pkg)) {
+            trace(repo, "dropping %s\n", pkg->name);
+
+            repo->cache = _alpm_pkghash_remove(repo->cache, pkg, NULL);
+            forget_package(repo, pkg);
+            repo->state = REPO_DIRTY;
+            repo->changes.dropped++;
+        }
+    }
+
+    return 0;
+}
+
+int repo_write(struct repo *repo)
+{
+    stats_attach(repo->stats);
+
+    /* an index asked for the first time is built even when nothing
+     * else changed */
+    if (repo->index && repo->state == REPO_CLEAN &&
+        faccessat(repo->rootfd, repo->indexname, F_OK, 0) < 0) {
+        if (errno != ENOENT) {
+            warn("couldn't access %s", repo->indexname);
+            return -1;
+        }
+        repo->state = REPO_DIRTY;
+    }
+
+    switch (repo->state) {
+    case REPO_NEW:
+        trace(repo, "repo empty!\n");
+        return 0;
+    case REPO_CLEAN:
+        trace(repo, "repo does not need updating\n");
+        return 0;
+    case REPO_DIRTY:
+        break;
+    }
+
+    if (render_db(repo) < 0)
+        return -1;
+
+    stats_begin(PHASE_LINK);
+    link_db(repo);
+    stats_end(PHASE_LINK);
+
+    repo->state = REPO_CLEAN;
+    return 1;
+}
+
+int repo_verify_links(struct repo *repo)
+{
+    stats_attach(repo->stats);
+
+    /* without a pool of its own, the root holds the packages themselves */
+    if (repo->pools[0].root)
+        return 0;
+
+    stats_begin(PHASE_LINK);
+    int ret = verify_links(repo);
+    stats_end(PHASE_LINK);
+
+    return ret;
+}
+
+/* Returns 1 if the database was loaded and 0 if there wasn't a usable
+ * one, in which case the repo is built from scratch. */
+static int load_db(struct repo *repo, const char *filename)
+{
+    _cleanup_close_ int dbfd = openat(repo->rootfd, filename, O_RDONLY);
+    if (dbfd < 0) {
+        if (errno == ENOENT)
+            return 0;
+
+        warn("failed to open database %s", filename);
+        return -1;
+    }
+
+    stats_begin(PHASE_LOAD_DB);
+    int ret = load_database(dbfd, &repo->cache, repo->spoolfd, &repo->arena, &repo->dirs);
+    stats_end(PHASE_LOAD_DB);
+
+    if (ret < 0) {
+        warn("failed to open %s database", filename);
+        return 0;
+    }
+
+    return 1;
+}
+
+static int find_signature(struct repo *repo, const char *name,
+                          const char **names, size_t *count)
+{
+    _cleanup_free_ char *sig = joinstring(name, ".sig", NULL);
+
+    if (faccessat(repo->rootfd, sig, F_OK, 0) == 0) {
+        names[(*count)++] = name;
+    } else if (errno != ENOENT) {
+        warn("couldn't access %s", sig);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Existing signatures are checked in the background while the
+ * databases load; check_signatures() waits for the verdict. */
+static int start_verification(struct repo *repo)
+{
+    const char *names[2];
+    size_t count = 0;
+
+    if (find_signature(repo, repo->dbname, names, &count) < 0)
+        return -1;
+    if (repo->filesname && find_signature(repo, repo->filesname, names, &count) < 0)
+        return -1;
+
+    if (count) {
+        repo->verification = signer_verify_start(repo->signer, repo->rootfd, names, count);
+        if (!repo->verification) {
+            warn("failed to start signature verification");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int check_signatures(struct repo *repo)
+{
+    if (!repo->verification)
+        return 0;
+
+    int rc = signer_verify_finish(repo->verification);
+    repo->verification = NULL;
+
+    if (rc < 0) {
+        warnx("repo signature is invalid or corrupt!");
+        return -1;
+    }
+
+    trace(repo, "found a valid signature, will resign...\n");
+    return 0;
+}
+
+static int open_pools(struct repo *repo)
+{
+    size_t i;
+
+    if (!repo->pool_count) {
+        /* without a pool, packages are served out of the root */
+        repo->root_pool = (struct pool){ .path = repo->root, .fd = repo->rootfd, .root = true };
+        repo->pools = &repo->root_pool;
+        repo->pool_count = 1;
+        return 0;
+    }
+
+    for (i = 0; i < repo->pool_count; ++i)
+        repo->pools[i].fd = -1;
+
+    for (i = 0; i < repo->pool_count; ++i) {
+        struct pool *pool = &repo->pools[i];
+
+        pool->fd = open(pool->path, O_RDONLY | O_DIRECTORY);
+        if (pool->fd < 0) {
+            warn("failed to open pool directory %s", pool->path);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int load_databases(struct repo *repo)
+{
+    /* old file lists are parked in an anonymous file rather than memory;
+     * without one, fall back to keeping them around */
+    if (repo->filesname) {
+        repo->spoolfd = openat(repo->rootfd, ".", O_TMPFILE | O_RDWR, 0600);
+        if (repo->spoolfd < 0)
+            trace(repo, "couldn't create a spool file, keeping file lists in memory\n");
+    }
+
+    int ret = load_db(repo, repo->dbname);
+    if (ret <= 0)
+        return ret;
+
+    if (repo->filesname && load_db(repo, repo->filesname) < 0)
+        return -1;
+
+    repo->state = REPO_CLEAN;
+    return 0;
+}
+
+int repo_open(struct repo *repo, const char *reponame, bool files, bool load_cache)
+{
+    repo->state = REPO_NEW;
+    repo->root_pool = (struct pool){ .fd = -1 };
+    repo->filecache = (struct filecache){ 0 };
+    repo->dbname = repo->filesname = repo->indexname = NULL;
+    repo->spoolfd = -1;
+    repo->arena = (struct arena){ 0 };
+    dirtable_init(&repo->dirs);
+    repo->stats = NULL;
+    repo->signer = NULL;
+    repo->verification = NULL;
+    repo->cache = NULL;
+    repo->unlinked = NULL;
+    repo->changes.added = repo->changes.updated = repo->changes.dropped = 0;
+    repo->deduped = (struct dedup_stats){ 0 };
+
+    repo->rootfd = open(repo->root, O_RDONLY | O_DIRECTORY);
+    if (repo->rootfd < 0) {
+        warn("failed to open root directory %s", repo->root);
+        return -1;
+    }
+
+    if (open_pools(repo) < 0)
+        goto error;
+
+    if (repo->collect_stats) {
+        repo->stats = stats_new();
+        if (!repo->stats) {
+            warn("failed to allocate memory");
+            goto error;
+        }
+    }
+
+    stats_attach(repo->stats);
+    stats_begin(PHASE_INIT);
+
+    repo->dbname = joinstring(reponame, ".db", NULL);
+    repo->filesname = joinstring(reponame, ".files", NULL);
+    if (repo->index)
+        repo->indexname = joinstring(reponame, ".idx", NULL);
+
+    if (!files && faccessat(repo->rootfd, repo->filesname, F_OK, 0) < 0) {
+        if (errno != ENOENT) {
+            warn("couldn't access %s", repo->filesname);
+            goto error;
+        }
+
+        free(repo->filesname);
+        repo->filesname = NULL;
+    }
+
+    /* one context for each database, or one per worker when there are
+     * packages to sign or check */
+    if (repo->sign || repo->sign_packages || repo->verify_packages) {
+        bool packages = repo->sign_packages || repo->verify_packages;
+
+        repo->signer = signer_new(repo->key, packages ? nr_workers() : 2);
+        if (!repo->signer) {
+            warnx("failed to initialize gpgme");
+            goto error;
+        }
+    }
+
+    if (repo->sign && start_verification(repo) < 0)
+        goto error;
+
+    repo->cache = _alpm_pkghash_create(100);
+    if (!repo->cache) {
+        warn("failed to allocate memory");
+        goto error;
+    }
+
+    if (load_cache && load_databases(repo) < 0)
+        goto error;
+
+    if (check_signatures(repo) < 0)
+        goto error;
+
+    stats_end(PHASE_INIT);
+    return 0;
+
+error:
+    repo_close(repo);
+    return -1;
+}
+
+void repo_close(struct repo *repo)
+{
+    size_t i;
+
+    if (repo->verification)
+        signer_verify_finish(repo->verification);
+    signer_free(repo->signer);
+
+    if (repo->cache) {
+        alpm_list_t *node;
+
+        for (node = repo->cache->list; node; node = node->next)
+            package_free(node->data);
+        _alpm_pkghash_free(repo->cache);
+    }
+
+    alpm_list_free(repo->unlinked);
+    filecache_free(&repo->filecache);
+    arena_free(&repo->arena);
+    /* only once every file list is gone */
+    dirtable_free(&repo->dirs);
+
+    for (i = 0; i < repo->pool_count; ++i) {
+        if (!repo->pools[i].root && repo->pools[i].fd >= 0)
+            close(repo->pools[i].fd);
+    }
+
+    /* the pools themselves are the caller's */
+    if (repo->pools == &repo->root_pool) {
+        repo->pools = NULL;
+        repo->pool_count = 0;
+    }
+
+    if (repo->spoolfd >= 0)
+        close(repo->spoolfd);
+    if (repo->rootfd >= 0)
+        close(repo->rootfd);
+
+    free(repo->dbname);
+    free(repo->filesname);
+    free(repo->indexname);
+    stats_free(repo->stats);
+
+    repo->verification = NULL;
+    repo->signer = NULL;
+    repo->cache = NULL;
+    repo->unlinked = NULL;
+    repo->dbname = repo->filesname = repo->indexname = NULL;
+    repo->stats = NULL;
+    repo->spoolfd = repo->rootfd = -1;
+}
@@ -0,0 +1,125 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <time.h>
+#include <alpm_list.h>
+
+#include "filecache.h"
+#include "filelist.h"
+#include "filters.h"
+#include "pkghash.h"
+#include "dedup.h"
+#include "decompress.h"
+
+enum repo_state {
+    REPO_NEW,
+    REPO_CLEAN,
+    REPO_DIRTY
+};
+
+/* A repository kept in memory between updates. Everything a run needs
+ * hangs off of it, so a process can hold several open at once, each used
+ * by one thread at a time. The caller fills in the settings, then
+ * repo_open() takes care of the rest. */
+struct repo {
+    /* settings */
+    const char *root;
+    struct pool *pools;
+    size_t pool_count;
+
+    int compression;
+    bool rsyncable;
+    /* negative to stamp entries with their package's builddate */
+    time_t epoch;
+    bool compat;
+    bool index;
+    bool sign;
+    bool sign_packages;
+    bool verify_packages;
+    const char *key;
+    bool dedup;
+    enum dedup_mode dedup_mode;
+    int verbose;
+    /* time the phases of every call into stats */
+    bool collect_stats;
+
+    /* state */
+    enum repo_state state;
+    int rootfd;
+    struct pool root_pool;
+    struct filecache filecache;
+
+    char *dbname;
+    char *filesname;
+    char *indexname;
+    int spoolfd;
+    /* databases are unpacked here, one after the other */
+    struct arena arena;
+    /* the directories of every file list */
+    struct dirtable dirs;
+    struct stats *stats;
+
+    struct signer *signer;
+    struct verification *verification;
+    alpm_pkghash_t *cache;
+    /* packages that came in since the last write and need a link in
+     * the root */
+    alpm_list_t *unlinked;
+
+    /* totals since the repo was opened */
+    struct {
+        unsigned long added;
+        unsigned long updated;
+        unsigned long dropped;
+    } changes;
+    struct dedup_stats deduped;
+};
+
+/* Open the root and the pools, and unless load_cache is false, load
+ * reponame's databases. The files database is kept if it already exists
+ * or files is set. When signing, the existing signatures have to check
+ * out. Every function here returns -1 on failure, after saying why on
+ * stderr. */
+int repo_open(struct repo *repo, const char *reponame, bool files, bool load_cache);
+void repo_close(struct repo *repo);
+
+/* Look over the pools again, picking up what changed on disk. */
+int repo_scan(struct repo *repo);
+
+/* Bring the cache in line with the pools: packages whose file is gone
+ * are dropped, and new or newer ones, limited to targets when given,
+ * added. */
+int repo_sync(struct repo *repo, const struct targets *targets, const char *arch);
+
+/* Move the packages waiting in the incoming directory into the first
+ * pool and add them. */
+int repo_add(struct repo *repo, const char *incoming, const struct targets *targets,
+             const char *arch);
+
+/* Take the packages matching targets out of the cache. */
+int repo_drop(struct repo *repo, const struct targets *targets);
+
+/* Write out the databases and the links for new packages if anything
+ * changed. Returns 1 when they were written and 0 when nothing needed
+ * to be. */
+int repo_write(struct repo *repo);
+
+/* Reconcile the links in the root with the cache. */
+int repo_verify_links(struct repo *repo);
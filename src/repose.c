@@ -18,6 +18,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
 #include <errno.h>
 #include <err.h>
 #include <getopt.h>
@@ -27,9 +29,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 
-#include "database.h"
-#include "filecache.h"
-#include "file.h"
+#include "repo.h"
 #include "util.h"
 #include "base64.h"
 
@@ -38,43 +38,10 @@
 #include <sys/stat.h>
 #include "pkghash.h"
 #include "filters.h"
-#include "signing.h"
-
-static struct utsname uts;
-static int verbose = 0;
-
-enum state {
-    REPO_NEW,
-    REPO_CLEAN,
-    REPO_DIRTY
-};
-
-struct repo {
-    enum state state;
-    const char *root;
-    const char *pool;
-    int rootfd;
-    int poolfd;
-
-    char *dbname;
-    char *filesname;
-
-    int compression;
-    bool compat;
-    bool sign;
-    alpm_pkghash_t *cache;
-};
-
-static inline _printf_(1,2) void trace(const char *fmt, ...)
-{
-    if (verbose) {
-        va_list ap;
-
-        va_start(ap, fmt);
-        vprintf(fmt, ap);
-        va_end(ap);
-    }
-}
+#include "stats.h"
+#include "metrics.h"
+#include "scrub.h"
+#include "index.h"
 
 static _noreturn_ void usage(FILE *out)
 {
@@ -85,14 +52,28 @@ static _noreturn_ void usage(FILE *out)
           " -v, --verbose         verbose output\n"
           " -f, --files           also build the .files database\n"
           " -d, --drop            drop the specified package from the db\n"
+          " -s, --sign            sign the databases\n"
           " -r, --root=PATH       set the root for the repository\n"
-          " -p, --pool=PATH       set the pool to find packages in\n"
+          " -p, --pool=PATH       add a pool to find packages in\n"
           " -m, --arch=ARCH       the architecture of the database\n"
           " -j, --bzip2           filter the archive through bzip2\n"
           " -J, --xz              filter the archive through xz\n"
           " -z, --gzip            filter the archive through gzip\n"
           " -Z, --compress        filter the archive through compress\n"
-          "     --rebuild         force rebuild the repo\n", out);
+          "     --rebuild         force rebuild the repo\n"
+          "     --rsyncable       make gzip output friendlier to rsync\n"
+          "     --sign-packages   sign new packages that have no signature\n"
+          "     --key=KEY         the key to sign with\n"
+          "     --verify-packages reject new packages without a good signature\n"
+          "     --verify-links    reconcile the links in the root with the db\n"
+          "     --ingest=PATH     move new packages from PATH into the pool\n"
+          "     --scrub[=RATE]    check the pool against the db's checksums\n"
+          "     --index           also write a query index\n"
+          "     --query=KIND      look up owner, provider or rdepends in the index\n"
+          "     --dedup[=MODE]    parse identical packages once, optionally link\n"
+          "                       or reflink the copies together\n"
+          "     --stats[=FORMAT]  report per-phase timings (text or json)\n"
+          "     --metrics=PATH    write prometheus metrics to PATH\n", out);
 
     exit(out == stderr ? EXIT_FAILURE : EXIT_SUCCESS);
 }
@@ -137,178 +118,6 @@ static _noreturn_ void elephant(void)
     exit(EXIT_FAILURE);
 }
 
-static inline int make_link(const struct pkg *pkg, int dirfd, const char *source)
-{
-    _cleanup_free_ char *link = joinstring(source, "/", pkg->filename, NULL);
-    return symlinkat(link, dirfd, pkg->filename);
-}
-
-static inline int compat_link(int rootdb, const char *reponame, int compression)
-{
-    static const char *ext[] = {
-        [ARCHIVE_FILTER_NONE]     = "",
-        [ARCHIVE_FILTER_BZIP2]    = ".bz2",
-        [ARCHIVE_FILTER_XZ]       = ".xz",
-        [ARCHIVE_FILTER_GZIP]     = ".gz",
-        [ARCHIVE_FILTER_COMPRESS] = ".Z"
-    };
-
-    _cleanup_free_ char *link = joinstring(reponame, ".tar", ext[compression], NULL);
-    return symlinkat(reponame, rootdb, link);
-}
-
-static int render_db(struct repo *repo, const char *name, enum contents what)
-{
-    _cleanup_close_ int dbfd = openat(repo->rootfd, name, O_CREAT | O_WRONLY | O_TRUNC, 0644);
-    if (dbfd < 0)
-        err(EXIT_FAILURE, "failed to open %s for writing", name);
-
-    if (save_database(dbfd, repo->cache, what, repo->compression, repo->poolfd) < 0)
-        err(EXIT_FAILURE, "failed to write %s", name);
-
-    if (repo->compat && compat_link(repo->rootfd, name, repo->compression) < 0) {
-        if (errno != EEXIST)
-            warn("failed to make compatability symlink to %s", name);
-    }
-
-    if (repo->sign) {
-        gpgme_sign(repo->rootfd, name, NULL);
-    }
-
-    return 0;
-}
-
-static inline int delete_link(const struct pkg *pkg, int dirfd)
-{
-    struct stat buf;
-    if (fstatat(dirfd, pkg->filename, &buf, AT_SYMLINK_NOFOLLOW) < 0)
-        return errno != ENOENT ? -1 : 0;
-
-    if (S_ISLNK(buf.st_mode))
-        return unlinkat(dirfd, pkg->filename, 0);
-    return 0;
-}
-
-static void link_db(struct repo *repo)
-{
-    alpm_list_t *node;
-
-    if (!repo->pool)
-        return;
-
-    for (node = repo->cache->list; node; node = node->next)
-        make_link(node->data, repo->rootfd, repo->pool);
-}
-
-static inline alpm_pkghash_t *_alpm_pkghash_replace(alpm_pkghash_t *cache, struct pkg *new,
-                                                    struct pkg *old)
-{
-    cache = _alpm_pkghash_remove(cache, old, NULL);
-    return _alpm_pkghash_add(cache, new);
-}
-
-static int reduce_repo(struct repo *repo)
-{
-    alpm_list_t *node;
-
-    for (node = repo->cache->list; node; node = node->next) {
-        struct pkg *pkg = node->data;
-
-        if (faccessat(repo->poolfd, pkg->filename, F_OK, 0) < 0) {
-            if (errno != ENOENT)
-                err(EXIT_FAILURE, "couldn't access package %s", pkg->filename);
-
-            trace("dropping %s\n", pkg->name);
-
-            repo->cache = _alpm_pkghash_remove(repo->cache, pkg, NULL);
-            delete_link(pkg, repo->rootfd);
-            package_free(pkg);
-            repo->state = REPO_DIRTY;
-        }
-    }
-
-    return 0;
-}
-
-static void drop_from_repo(struct repo *repo, alpm_list_t *targets)
-{
-    alpm_list_t *node;
-
-    if (!targets)
-        return;
-
-    for (node = repo->cache->list; node; node = node->next) {
-        struct pkg *pkg = node->data;
-
-        if (match_targets(pkg, targets)) {
-            trace("dropping %s\n", pkg->name);
-
-            repo->cache = _alpm_pkghash_remove(repo->cache, pkg, NULL);
-            delete_link(pkg, repo->rootfd);
-            package_free(pkg);
-            repo->state = REPO_DIRTY;
-        }
-    }
-}
-
-static bool update_repo(struct repo *repo, alpm_pkghash_t *src)
-{
-    alpm_list_t *node;
-    bool dirty = false;
-
-    for (node = src->list; node; node = node->next) {
-        struct pkg *pkg = node->data;
-        struct pkg *old = _alpm_pkghash_find(repo->cache, pkg->name);
-        bool replace = false;
-        int vercmp;
-
-        /* if the package isn't in the cache, add it */
-        if (!old) {
-            trace("adding %s %s\n", pkg->name, pkg->version);
-
-            repo->cache = _alpm_pkghash_add(repo->cache, pkg);
-            dirty = true;
-            continue;
-        }
-
-        vercmp = alpm_pkg_vercmp(pkg->version, old->version);
-
-        switch(vercmp) {
-            case 1:
-                trace("updating %s %s => %s\n", pkg->name, old->version, pkg->version);
-
-                replace = true;
-                break;
-            case 0:
-                if (pkg->mtime > old->mtime) {
-                    trace("updating %s %s [newer timestamp]\n", pkg->name, pkg->version);
-
-                    replace = true;
-                } else if (pkg->builddate > old->builddate) {
-                    trace("updating %s %s [newer build]\n", pkg->name, pkg->version);
-
-                    replace = true;
-                } else if (old->base64sig == NULL && pkg->base64sig) {
-                    trace("adding signature for %s\n", pkg->name);
-
-                    replace = true;
-                }
-                break;
-            case -1:
-                break;
-        }
-
-        if (replace) {
-            repo->cache = _alpm_pkghash_replace(repo->cache, pkg, old);
-            delete_link(pkg, repo->rootfd);
-            package_free(old);
-            dirty = true;
-        }
-    }
-
-    return dirty;
-}
-
 /* NOTES TO SELF:
  * - do i really need to do a merge when there's no database?
  *    - how do i handle stdout then?
@@ -316,94 +125,109 @@ static bool update_repo(struct repo *repo, alpm_pkghash_t *src)
  * - minimal stdout
  */
 
-static alpm_list_t *parse_targets(char *targets[], int count)
+static struct targets *parse_targets(char *targets[], int count)
 {
     int i;
     alpm_list_t *list = NULL;
+    struct targets *compiled;
+
+    if (count == 0)
+        return NULL;
 
     for (i = 0; i < count; ++i)
         list = alpm_list_add(list, targets[i]);
 
-    return list;
+    compiled = compile_targets(list);
+    if (!compiled)
+        err(EXIT_FAILURE, "failed to compile targets");
+
+    alpm_list_free(list);
+    return compiled;
 }
 
-static int load_db(struct repo *repo, const char *filename)
+static void export_metrics(struct repo *repo, const char *rootname, const char *path,
+                           bool written)
 {
-    _cleanup_close_ int dbfd = openat(repo->rootfd, filename, O_RDONLY);
-    if (dbfd < 0) {
-        if (errno != ENOENT)
-            err(EXIT_FAILURE, "failed to open database %s", filename);
-        return -1;
-    }
+    struct run_metrics metrics = {
+        .repo     = rootname,
+        .packages = repo->cache->entries,
+        .added    = repo->changes.added,
+        .updated  = repo->changes.updated,
+        .dropped  = repo->changes.dropped,
+        .written  = written,
+        .stats    = repo->stats
+    };
+    struct stat st;
 
-    if (load_database(dbfd, &repo->cache) < 0) {
-        warn("failed to open %s database", filename);
-        return -1;
+    if (metrics.written) {
+        if (fstatat(repo->rootfd, repo->dbname, &st, 0) == 0)
+            metrics.db_size = st.st_size;
+        if (repo->filesname && fstatat(repo->rootfd, repo->filesname, &st, 0) == 0)
+            metrics.files_size = st.st_size;
     }
 
-    return 0;
+    if (write_metrics(path, &metrics) < 0)
+        warn("failed to write metrics to %s", path);
 }
 
-static void check_signature(struct repo *repo, const char *name)
+static enum index_table query_table(const char *kind)
 {
-    _cleanup_free_ char *sig = joinstring(name, ".sig", NULL);
-
-    if (faccessat(repo->rootfd, sig, F_OK, 0) == 0) {
-        if (gpgme_verify(repo->rootfd, name) < 0) {
-            errx(EXIT_FAILURE, "repo signature is invalid or corrupt!");
-        } else {
-            trace("found a valid signature, will resign...\n");
-            repo->sign = true;
-        }
-    } else if (errno != ENOENT) {
-        err(EXIT_FAILURE, "countn't access %s", name);
-    }
+    if (streq(kind, "owner"))
+        return INDEX_FILES;
+    else if (streq(kind, "provider"))
+        return INDEX_PROVIDES;
+    else if (streq(kind, "rdepends"))
+        return INDEX_DEPENDS;
+
+    errx(EXIT_FAILURE, "unknown query %s", kind);
 }
 
-static void init_repo(struct repo *repo, const char *reponame, bool files,
-                      bool load_cache)
+/* Answered straight off the index, the databases aren't touched */
+static int query_index(const char *root, const char *reponame, enum index_table table,
+                       char *keys[], int count)
 {
-    repo->rootfd = open(repo->root, O_RDONLY | O_DIRECTORY);
-    if (repo->rootfd < 0)
-        err(EXIT_FAILURE, "failed to open root directory %s", repo->root);
-
-    if (repo->pool) {
-        repo->poolfd = open(repo->pool, O_RDONLY | O_DIRECTORY);
-        if (repo->poolfd < 0)
-            err(EXIT_FAILURE, "failed to open pool directory %s", repo->pool);
-    } else {
-        repo->poolfd = repo->rootfd;
-    }
-
-    repo->dbname = joinstring(reponame, ".db", NULL);
-    repo->filesname = joinstring(reponame, ".files", NULL);
-
-    if (!files && faccessat(repo->rootfd, repo->filesname, F_OK, 0) < 0) {
-        if (errno == ENOENT) {
-            free(repo->filesname);
-            repo->filesname = NULL;
-        } else {
-            err(EXIT_FAILURE, "couldn't access %s", repo->filesname);
+    _cleanup_free_ char *indexname = joinstring(reponame, ".idx", NULL);
+    _cleanup_close_ int rootfd = open(root, O_RDONLY | O_DIRECTORY);
+    struct index index;
+    int i, ret = EXIT_SUCCESS;
+
+    if (rootfd < 0)
+        err(EXIT_FAILURE, "failed to open root directory %s", root);
+    if (index_open(&index, rootfd, indexname) < 0)
+        err(EXIT_FAILURE, "failed to open %s", indexname);
+
+    for (i = 0; i < count; ++i) {
+        if (index_query(&index, table, keys[i], stdout) == 0) {
+            warnx("nothing found for %s", keys[i]);
+            ret = EXIT_FAILURE;
         }
     }
 
-    if (repo->sign) {
-        check_signature(repo, repo->dbname);
-        check_signature(repo, repo->filesname);
-    }
+    index_close(&index);
+    return ret;
+}
 
-    repo->cache = _alpm_pkghash_create(100);
+/* a byte count with an optional binary K, M or G suffix */
+static int parse_rate(const char *str, unsigned long *rate)
+{
+    char *end;
 
-    if (!load_cache)
-        return;
+    errno = 0;
+    unsigned long value = strtoul(str, &end, 10);
+    if (errno || end == str || *str == '-')
+        return -1;
 
-    if (load_db(repo, repo->dbname) < 0)
-        return;
+    switch (*end) {
+    case 'G': value <<= 10; /* fallthrough */
+    case 'M': value <<= 10; /* fallthrough */
+    case 'K': value <<= 10; ++end; break;
+    }
 
-    if (repo->filesname)
-        load_db(repo, repo->filesname);
+    if (*end)
+        return -1;
 
-    repo->state = REPO_CLEAN;
+    *rate = value;
+    return 0;
 }
 
 static char *get_rootname(char *name)
@@ -417,8 +241,13 @@ static char *get_rootname(char *name)
 int main(int argc, char *argv[])
 {
     const char *rootname;
-    const char *arch = NULL;
-    bool files = false, rebuild = false, drop = false;
+    const char *arch = NULL, *metrics = NULL, *ingest = NULL, *query = NULL;
+    bool files = false, rebuild = false, drop = false, stats = false;
+    bool check_links = false, scrub = false;
+    unsigned long scrub_rate = 0;
+    struct utsname uts;
+    int written;
+    enum stats_format stats_format = STATS_TEXT;
 
     static const struct option opts[] = {
         { "help",     no_argument,       0, 'h' },
@@ -437,15 +266,27 @@ int main(int argc, char *argv[])
         { "rebuild",  no_argument,       0, 0x100 },
         { "compat",   no_argument,       0, 0x101 },
         { "elephant", no_argument,       0, 0x102 },
+        { "stats",    optional_argument, 0, 0x103 },
+        { "metrics",  required_argument, 0, 0x104 },
+        { "rsyncable", no_argument,      0, 0x105 },
+        { "sign-packages", no_argument,  0, 0x106 },
+        { "key",      required_argument, 0, 0x107 },
+        { "verify-packages", no_argument, 0, 0x108 },
+        { "verify-links", no_argument,   0, 0x109 },
+        { "ingest",   required_argument, 0, 0x10a },
+        { "scrub",    optional_argument, 0, 0x10b },
+        { "index",    no_argument,       0, 0x10c },
+        { "query",    required_argument, 0, 0x10d },
+        { "dedup",    optional_argument, 0, 0x10e },
         { 0, 0, 0, 0 }
     };
 
     struct repo repo = {
-        .state       = REPO_NEW,
         .root        = ".",
         .compression = ARCHIVE_COMPRESSION_NONE,
         .compat      = false,
-        .sign        = false
+        .sign        = false,
+        .epoch       = -1
     };
 
     for (;;) {
@@ -461,7 +302,7 @@ int main(int argc, char *argv[])
             printf("%s %s\n",  program_invocation_short_name, REPOSE_VERSION);
             exit(EXIT_SUCCESS);
         case 'v':
-            verbose += 1;
+            repo.verbose += 1;
             break;
         case 'd':
             drop = true;
@@ -476,7 +317,8 @@ int main(int argc, char *argv[])
             repo.root = optarg;
             break;
         case 'p':
-            repo.pool = optarg;
+            repo.pools = realloc(repo.pools, (repo.pool_count + 1) * sizeof(struct pool));
+            repo.pools[repo.pool_count++] = (struct pool){ .path = optarg };
             break;
         case 'm':
             arch = optarg;
@@ -502,9 +344,77 @@ int main(int argc, char *argv[])
         case 0x102:
             elephant();
             break;
+        case 0x103:
+            stats = true;
+            if (!optarg || streq(optarg, "text"))
+                stats_format = STATS_TEXT;
+            else if (streq(optarg, "json"))
+                stats_format = STATS_JSON;
+            else
+                errx(EXIT_FAILURE, "unknown stats format %s", optarg);
+            break;
+        case 0x104:
+            metrics = optarg;
+            break;
+        case 0x105:
+            repo.rsyncable = true;
+            break;
+        case 0x106:
+            repo.sign_packages = true;
+            break;
+        case 0x107:
+            repo.key = optarg;
+            break;
+        case 0x108:
+            repo.verify_packages = true;
+            break;
+        case 0x109:
+            check_links = true;
+            break;
+        case 0x10a:
+            ingest = optarg;
+            break;
+        case 0x10b:
+            scrub = true;
+            if (optarg && parse_rate(optarg, &scrub_rate) < 0)
+                errx(EXIT_FAILURE, "invalid scrub rate %s", optarg);
+            break;
+        case 0x10c:
+            repo.index = true;
+            break;
+        case 0x10d:
+            query = optarg;
+            break;
+        case 0x10e:
+            repo.dedup = true;
+            if (!optarg)
+                repo.dedup_mode = DEDUP_DETECT;
+            else if (streq(optarg, "link"))
+                repo.dedup_mode = DEDUP_HARDLINK;
+            else if (streq(optarg, "reflink"))
+                repo.dedup_mode = DEDUP_REFLINK;
+            else
+                errx(EXIT_FAILURE, "unknown dedup mode %s", optarg);
+            break;
         }
     }
 
+    if (repo.rsyncable && repo.compression != ARCHIVE_FILTER_GZIP)
+        warnx("--rsyncable only applies to gzip compression, ignoring");
+    if (ingest && drop)
+        errx(EXIT_FAILURE, "--ingest can't be combined with --drop");
+    if (scrub && (drop || rebuild || ingest))
+        errx(EXIT_FAILURE, "--scrub can't be combined with --drop, --rebuild or --ingest");
+
+    const char *source_date_epoch = getenv("SOURCE_DATE_EPOCH");
+    if (source_date_epoch) {
+        long epoch;
+
+        if (xstrtol(source_date_epoch, &epoch) < 0 || epoch < 0)
+            errx(EXIT_FAILURE, "invalid SOURCE_DATE_EPOCH %s", source_date_epoch);
+        repo.epoch = epoch;
+    }
+
     argv += optind;
     argc -= optind;
 
@@ -516,45 +426,64 @@ int main(int argc, char *argv[])
         arch = uts.machine;
     }
 
+    repo.collect_stats = stats || metrics;
+
     rootname = get_rootname(argv[0]);
-    init_repo(&repo, rootname, files, !rebuild);
 
-    alpm_list_t *targets = parse_targets(&argv[1], argc - 1);
+    if (query)
+        return query_index(repo.root, rootname, query_table(query), &argv[1], argc - 1);
 
-    if (drop) {
-        drop_from_repo(&repo, targets);
-    } else {
-        alpm_pkghash_t *filecache = get_filecache(repo.poolfd, targets, arch);
-        if (!filecache)
-            err(EXIT_FAILURE, "failed to get filecache");
+    if (repo_open(&repo, rootname, files, !rebuild) < 0)
+        return EXIT_FAILURE;
 
-        reduce_repo(&repo);
+    struct targets *targets = parse_targets(&argv[1], argc - 1);
+    int ret, status = EXIT_FAILURE;
 
-        if (update_repo(&repo, filecache))
-            repo.state = REPO_DIRTY;
-    }
+    /* a scrub only reads, the database is left as it is */
+    if (scrub) {
+        if (repo_scan(&repo) < 0)
+            goto done;
 
-    switch (repo.state) {
-    case REPO_NEW:
-        trace("repo empty!\n");
-        break;
-    case REPO_CLEAN:
-        trace("repo does not need updating\n");
-        break;
-    case REPO_DIRTY:
-        trace("writing %s...\n", repo.dbname);
-        render_db(&repo, repo.dbname, DB_DESC | DB_DEPENDS);
+        stats_begin(PHASE_HASH);
+        ret = scrub_repo(repo.cache, &repo.filecache, targets, scrub_rate, stdout);
+        stats_end(PHASE_HASH);
 
-        if (repo.filesname) {
-            trace("writing %s...\n", repo.filesname);
-            render_db(&repo, repo.filesname, DB_FILES);
+        if (ret < 0) {
+            warn("failed to scrub %s", repo.dbname);
+            goto done;
         }
+        if (stats)
+            stats_print(repo.stats, stderr, stats_format);
+        status = ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        goto done;
+    }
 
-        link_db(&repo);
-        break;
-    default:
-        break;
+    if (drop) {
+        ret = repo_drop(&repo, targets);
+    } else {
+        ret = repo_sync(&repo, targets, arch);
+        if (ret == 0 && repo.dedup)
+            printf("%zu duplicate packages, %zu replaced, %jd bytes reclaimed\n",
+                   repo.deduped.duplicates, repo.deduped.replaced,
+                   (intmax_t)repo.deduped.saved);
+        if (ret == 0 && ingest)
+            ret = repo_add(&repo, ingest, targets, arch);
     }
 
-    return 0;
+    if (ret < 0 || (written = repo_write(&repo)) < 0)
+        goto done;
+
+    if (check_links)
+        repo_verify_links(&repo);
+
+    if (stats)
+        stats_print(repo.stats, stderr, stats_format);
+    if (metrics)
+        export_metrics(&repo, rootname, metrics, written > 0);
+    status = EXIT_SUCCESS;
+
+done:
+    free_targets(targets);
+    repo_close(&repo);
+    return status;
 }
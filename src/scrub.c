@@ -0,0 +1,315 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#include "scrub.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#include "stats.h"
+#include "util.h"
+
+#define SCRUB_CHUNK (256 * 1024)
+
+enum verdict {
+    SCRUB_OK,
+    SCRUB_MISSING,
+    SCRUB_SIZE,
+    SCRUB_SHA256,
+    SCRUB_ERROR,
+    SCRUB_UNCHECKED
+};
+
+struct result {
+    const struct pkg *pkg;
+    const struct pool_file *file;
+    enum verdict verdict;
+    off_t size;
+    int error;
+    char sha256[2 * SHA256_DIGEST_LENGTH + 1];
+};
+
+/* A single budget shared by every worker: each chunk books the next
+ * slice of time at the configured rate and sleeps until it comes up. */
+struct throttle {
+    pthread_mutex_t lock;
+    unsigned long rate;
+    uint64_t next;
+};
+
+struct scrub {
+    const struct filecache *files;
+    struct throttle throttle;
+    struct result *results;
+    size_t count;
+    atomic_size_t next;
+    atomic_uint_fast64_t bytes;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void throttle(struct throttle *t, size_t bytes)
+{
+    uint64_t now, start;
+
+    if (!t->rate)
+        return;
+
+    now = now_ns();
+
+    pthread_mutex_lock(&t->lock);
+    start = t->next > now ? t->next : now;
+    t->next = start + (uint64_t)bytes * 1000000000 / t->rate;
+    pthread_mutex_unlock(&t->lock);
+
+    if (start > now) {
+        struct timespec ts = {
+            .tv_sec  = start / 1000000000,
+            .tv_nsec = start % 1000000000
+        };
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+    }
+}
+
+static void scrub_file(struct scrub *s, struct result *r)
+{
+    EVP_MD_CTX *ctx;
+    unsigned char buf[SCRUB_CHUNK], digest[EVP_MAX_MD_SIZE];
+    unsigned int len;
+    struct stat st;
+    off_t offset = 0;
+    size_t i;
+
+    _cleanup_close_ int fd = openat(r->file->pool->fd, r->file->path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        r->verdict = errno == ENOENT ? SCRUB_MISSING : SCRUB_ERROR;
+        r->error = errno;
+        return;
+    }
+    stats_open();
+
+    r->size = st.st_size;
+    if ((size_t)st.st_size != r->pkg->size) {
+        r->verdict = SCRUB_SIZE;
+        return;
+    }
+
+    if (!r->pkg->sha256sum) {
+        r->verdict = SCRUB_UNCHECKED;
+        return;
+    }
+
+    ctx = EVP_MD_CTX_new();
+    if (!ctx || !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
+        r->verdict = SCRUB_ERROR;
+        r->error = ENOMEM;
+        EVP_MD_CTX_free(ctx);
+        return;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    /* only what's actually going to be read is booked against the rate */
+    while (offset < st.st_size) {
+        off_t left = st.st_size - offset;
+        size_t want = left < (off_t)sizeof(buf) ? (size_t)left : sizeof(buf);
+        ssize_t n;
+
+        throttle(&s->throttle, want);
+        do {
+            n = read(fd, buf, want);
+        } while (n < 0 && errno == EINTR);
+
+        if (n < 0) {
+            r->verdict = SCRUB_ERROR;
+            r->error = errno;
+            EVP_MD_CTX_free(ctx);
+            return;
+        }
+        /* it shrank since the stat, the digest will say so */
+        if (n == 0)
+            break;
+
+        EVP_DigestUpdate(ctx, buf, n);
+        stats_read(n);
+        atomic_fetch_add(&s->bytes, n);
+
+        /* don't push what's being served out of the page cache */
+        posix_fadvise(fd, offset, n, POSIX_FADV_DONTNEED);
+        offset += n;
+    }
+
+    EVP_DigestFinal_ex(ctx, digest, &len);
+    EVP_MD_CTX_free(ctx);
+
+    for (i = 0; i < len; ++i)
+        sprintf(&r->sha256[2 * i], "%02x", digest[i]);
+
+    r->verdict = streq(r->sha256, r->pkg->sha256sum) ? SCRUB_OK : SCRUB_SHA256;
+}
+
+static void *scrub_worker(void *arg)
+{
+    struct scrub *s = arg;
+
+    for (;;) {
+        size_t i = atomic_fetch_add(&s->next, 1);
+        if (i >= s->count)
+            break;
+
+        struct result *r = &s->results[i];
+        if (r->file)
+            scrub_file(s, r);
+    }
+
+    return NULL;
+}
+
+static void print_string(FILE *out, const char *str)
+{
+    fputc('"', out);
+    for (; *str; ++str) {
+        unsigned char c = *str;
+
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static void print_entry(FILE *out, const struct result *r, bool *first)
+{
+    fputs(*first ? "{\"name\":" : ",{\"name\":", out);
+    print_string(out, r->pkg->name);
+    fputs(",\"filename\":", out);
+    print_string(out, r->pkg->filename);
+
+    switch (r->verdict) {
+    case SCRUB_SIZE:
+        fprintf(out, ",\"reason\":\"size\",\"expected\":%zu,\"actual\":%lld",
+                r->pkg->size, (long long)r->size);
+        break;
+    case SCRUB_SHA256:
+        fputs(",\"reason\":\"sha256\",\"expected\":", out);
+        print_string(out, r->pkg->sha256sum);
+        fputs(",\"actual\":", out);
+        print_string(out, r->sha256);
+        break;
+    case SCRUB_ERROR:
+        fputs(",\"error\":", out);
+        print_string(out, strerror(r->error));
+        break;
+    default:
+        break;
+    }
+
+    fputc('}', out);
+    *first = false;
+}
+
+static void print_list(FILE *out, const char *name, const struct scrub *s,
+                       enum verdict a, enum verdict b)
+{
+    bool first = true;
+    size_t i;
+
+    fprintf(out, ",\"%s\":[", name);
+    for (i = 0; i < s->count; ++i) {
+        if (s->results[i].verdict == a || s->results[i].verdict == b)
+            print_entry(out, &s->results[i], &first);
+    }
+    fputc(']', out);
+}
+
+int scrub_repo(alpm_pkghash_t *cache, const struct filecache *files,
+               const struct targets *targets, unsigned long rate, FILE *out)
+{
+    struct scrub s = {
+        .files    = files,
+        .throttle = { .lock = PTHREAD_MUTEX_INITIALIZER, .rate = rate },
+        .results  = calloc(cache->entries, sizeof(struct result))
+    };
+    size_t i, checked = 0, unchecked = 0, bad = 0;
+    alpm_list_t *node;
+
+    if (cache->entries && !s.results)
+        return -1;
+
+    /* report in name order, whatever order the database came in */
+    _alpm_pkghash_sort(cache);
+
+    for (node = cache->list; node; node = node->next) {
+        const struct pkg *pkg = node->data;
+
+        if (targets && !match_targets(targets, pkg))
+            continue;
+
+        s.results[s.count++] = (struct result){
+            .pkg     = pkg,
+            .file    = filecache_find(files, pkg->filename),
+            .verdict = SCRUB_MISSING
+        };
+    }
+
+    run_parallel(nr_workers(), scrub_worker, &s);
+
+    for (i = 0; i < s.count; ++i) {
+        switch (s.results[i].verdict) {
+        case SCRUB_OK:
+            ++checked;
+            break;
+        case SCRUB_UNCHECKED:
+            ++unchecked;
+            break;
+        default:
+            ++bad;
+            break;
+        }
+    }
+
+    fprintf(out, "{\"packages\":%zu,\"verified\":%zu,\"unchecked\":%zu,\"bytes\":%lu",
+            s.count, checked, unchecked, (unsigned long)s.bytes);
+    print_list(out, "missing", &s, SCRUB_MISSING, SCRUB_MISSING);
+    print_list(out, "mismatched", &s, SCRUB_SIZE, SCRUB_SHA256);
+    print_list(out, "errors", &s, SCRUB_ERROR, SCRUB_ERROR);
+    fputs("}\n", out);
+
+    free(s.results);
+    return bad ? 1 : 0;
+}
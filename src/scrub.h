@@ -0,0 +1,31 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include "pkghash.h"
+#include "filecache.h"
+#include "filters.h"
+
+/* Check every package in the cache, or just the targets, against the
+ * pool: each file has to exist and match its recorded size and sha256.
+ * Files are hashed in parallel, at no more than rate bytes a second in
+ * total unless rate is 0. A JSON report goes to out. Returns 1 if any
+ * problem was found, 0 if none, and -1 on error. */
+int scrub_repo(alpm_pkghash_t *cache, const struct filecache *files,
+               const struct targets *targets, unsigned long rate, FILE *out);
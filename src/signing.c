@@ -26,11 +26,16 @@
 #include <errno.h>
 #include <err.h>
 #include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <gpgme.h>
 
+#include "stats.h"
 #include "util.h"
 
-static void _noreturn_ _printf_(3,4) gpgme_err(int eval, gpgme_error_t err, const char *fmt, ...)
+static void _printf_(2,3) gpgme_warn(gpgme_error_t err, const char *fmt, ...)
 {
     fprintf(stderr, "%s: ", program_invocation_short_name);
 
@@ -44,7 +49,6 @@ static void _noreturn_ _printf_(3,4) gpgme_err(int eval, gpgme_error_t err, cons
     }
 
     fprintf(stderr, "%s\n", gpgme_strerror(err));
-    exit(eval);
 }
 
 static inline char *sig_for(const char *file)
@@ -52,16 +56,14 @@ static inline char *sig_for(const char *file)
     return joinstring(file, ".sig", NULL);
 }
 
-static int init_gpgme(void)
+static pthread_once_t gpgme_once = PTHREAD_ONCE_INIT;
+static int gpgme_status = -1;
+
+static void setup_gpgme(void)
 {
-    static int inited = false;
     gpgme_error_t err;
     gpgme_engine_info_t enginfo;
 
-    /* we already successfully initialized the library */
-    if (inited)
-        return 0;
-
     /* calling gpgme_check_version() returns the current version and runs
      * some internal library setup code */
     gpgme_check_version(NULL);
@@ -73,51 +75,195 @@ static int init_gpgme(void)
     /* check for OpenPGP support (should be a no-brainer, but be safe) */
     err = gpgme_engine_check_version(GPGME_PROTOCOL_OpenPGP);
     if (gpg_err_code(err) != GPG_ERR_NO_ERROR)
-        return -1;
+        return;
 
     err = gpgme_get_engine_info(&enginfo);
     if (gpg_err_code(err) != GPG_ERR_NO_ERROR)
-        return -1;
+        return;
 
-    inited = true;
-    return 0;
+    gpgme_status = 0;
 }
 
-int gpgme_verify(int rootfd, const char *file)
+/* the library is set up once per process, however many signers come
+ * and go, and from whichever thread gets there first */
+static int init_gpgme(void)
+{
+    pthread_once(&gpgme_once, setup_gpgme);
+    return gpgme_status;
+}
+
+struct signer {
+    gpgme_key_t key;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    gpgme_ctx_t *contexts;
+    gpgme_ctx_t *idle;
+    size_t count;
+    size_t idle_count;
+};
+
+struct batch {
+    struct signer *signer;
+    int rootfd;
+    const char *const *files;
+    size_t count;
+    atomic_size_t next;
+    atomic_bool failed;
+};
+
+struct verification {
+    struct batch batch;
+    const char **files;
+    pthread_t thread;
+    bool threaded;
+    struct stats *stats;
+};
+
+struct signer *signer_new(const char *key, size_t contexts)
 {
     gpgme_error_t err;
+    struct signer *signer;
+    size_t i;
+
+    if (init_gpgme() < 0)
+        return NULL;
+
+    signer = calloc(1, sizeof(struct signer));
+    if (!signer)
+        return NULL;
+
+    signer->contexts = calloc(contexts, sizeof(gpgme_ctx_t));
+    signer->idle = calloc(contexts, sizeof(gpgme_ctx_t));
+    if (!signer->contexts || !signer->idle) {
+        free(signer->contexts);
+        free(signer->idle);
+        free(signer);
+        return NULL;
+    }
+
+    pthread_mutex_init(&signer->lock, NULL);
+    pthread_cond_init(&signer->cond, NULL);
+
+    for (i = 0; i < contexts; ++i) {
+        gpgme_ctx_t ctx;
+
+        err = gpgme_new(&ctx);
+        if (gpg_err_code(err) != GPG_ERR_NO_ERROR) {
+            gpgme_warn(err, "failed to call gpgme_new()");
+            goto error;
+        }
+
+        signer->contexts[signer->count++] = ctx;
+        signer->idle[signer->idle_count++] = ctx;
+
+        if (key) {
+            if (!signer->key) {
+                err = gpgme_get_key(ctx, key, &signer->key, 1);
+                if (err) {
+                    gpgme_warn(err, "failed to set key %s", key);
+                    goto error;
+                }
+            }
+
+            err = gpgme_signers_add(ctx, signer->key);
+            if (gpg_err_code(err) != GPG_ERR_NO_ERROR) {
+                gpgme_warn(err, "failed to call gpgme_signers_add()");
+                goto error;
+            }
+        }
+    }
+
+    return signer;
+
+error:
+    signer_free(signer);
+    return NULL;
+}
+
+void signer_free(struct signer *signer)
+{
+    size_t i;
+
+    if (!signer)
+        return;
+
+    for (i = 0; i < signer->count; ++i)
+        gpgme_release(signer->contexts[i]);
+    if (signer->key)
+        gpgme_key_unref(signer->key);
+
+    pthread_cond_destroy(&signer->cond);
+    pthread_mutex_destroy(&signer->lock);
+    free(signer->contexts);
+    free(signer->idle);
+    free(signer);
+}
+
+static gpgme_ctx_t signer_acquire(struct signer *signer)
+{
     gpgme_ctx_t ctx;
+
+    pthread_mutex_lock(&signer->lock);
+    while (signer->idle_count == 0)
+        pthread_cond_wait(&signer->cond, &signer->lock);
+    ctx = signer->idle[--signer->idle_count];
+    pthread_mutex_unlock(&signer->lock);
+
+    return ctx;
+}
+
+static void signer_release(struct signer *signer, gpgme_ctx_t ctx)
+{
+    pthread_mutex_lock(&signer->lock);
+    signer->idle[signer->idle_count++] = ctx;
+    pthread_cond_signal(&signer->cond);
+    pthread_mutex_unlock(&signer->lock);
+}
+
+static int verify_file(gpgme_ctx_t ctx, int rootfd, const char *file)
+{
+    gpgme_error_t err;
     gpgme_data_t in, sig;
     gpgme_verify_result_t result;
     gpgme_signature_t sigs;
     int rc = 0;
 
-    if (init_gpgme() < 0)
-        return -1;
-
     _cleanup_free_ char *sigfile = sig_for(file);
     _cleanup_close_ int sigfd = openat(rootfd, sigfile, O_RDONLY);
     _cleanup_close_ int fd = openat(rootfd, file, O_RDONLY);
 
-    err = gpgme_new(&ctx);
-    if (gpg_err_code(err) != GPG_ERR_NO_ERROR)
-        gpgme_err(EXIT_FAILURE, err, "failed to call gpgme_new()");
+    if (sigfd < 0 || fd < 0) {
+        warn("couldn't open %s", sigfd < 0 ? sigfile : file);
+        return -1;
+    }
 
     err = gpgme_data_new_from_fd(&in, fd);
-    if (err)
-        gpgme_err(EXIT_FAILURE, err, "error reading %s", file);
+    if (err) {
+        gpgme_warn(err, "error reading %s", file);
+        return -1;
+    }
 
     err = gpgme_data_new_from_fd(&sig, sigfd);
-    if (gpg_err_code(err) != GPG_ERR_NO_ERROR)
-        gpgme_err(EXIT_FAILURE, err, "error reading %s", sigfile);
+    if (gpg_err_code(err) != GPG_ERR_NO_ERROR) {
+        gpgme_warn(err, "error reading %s", sigfile);
+        gpgme_data_release(in);
+        return -1;
+    }
 
     err = gpgme_op_verify(ctx, sig, in, NULL);
-    if (gpg_err_code(err) != GPG_ERR_NO_ERROR)
-        gpgme_err(EXIT_FAILURE, err, "failed to verify");
+    if (gpg_err_code(err) != GPG_ERR_NO_ERROR) {
+        gpgme_warn(err, "failed to verify %s", file);
+        gpgme_data_release(in);
+        gpgme_data_release(sig);
+        return -1;
+    }
 
     result = gpgme_op_verify_result(ctx);
     sigs = result->signatures;
-    if (gpgme_err_code(sigs->status) != GPG_ERR_NO_ERROR) {
+    if (!sigs) {
+        warnx("no signature found");
+        rc = -1;
+    } else if (gpgme_err_code(sigs->status) != GPG_ERR_NO_ERROR) {
         warnx("unexpected signature status: %s", gpgme_strerror(sigs->status));
         rc = -1;
     } else if (sigs->next) {
@@ -139,69 +285,254 @@ int gpgme_verify(int rootfd, const char *file)
 
     gpgme_data_release(in);
     gpgme_data_release(sig);
-    gpgme_release(ctx);
     return rc;
 }
 
-void gpgme_sign(int rootfd, const char *file, const char *key)
+/* make a detached signature of in, handed back as gpgme's memory */
+static char *sign_data(gpgme_ctx_t ctx, gpgme_data_t in, size_t *len)
+{
+    gpgme_error_t gpgerr;
+    gpgme_data_t out;
+
+    gpgerr = gpgme_data_new(&out);
+    if (gpg_err_code(gpgerr) != GPG_ERR_NO_ERROR) {
+        gpgme_warn(gpgerr, "failed to call gpgme_data_new()");
+        return NULL;
+    }
+
+    gpgerr = gpgme_op_sign(ctx, in, out, GPGME_SIG_MODE_DETACH);
+    if (gpgerr || !gpgme_op_sign_result(ctx)) {
+        gpgme_warn(gpgerr, "signing failed");
+        gpgme_data_release(out);
+        return NULL;
+    }
+
+    /* take the signature straight out of gpgme's buffer */
+    return gpgme_data_release_and_get_mem(out, len);
+}
+
+static int sign_file(gpgme_ctx_t ctx, int rootfd, const char *file)
+{
+    gpgme_error_t gpgerr;
+    gpgme_data_t in;
+    char *sig;
+    size_t len, written = 0;
+
+    _cleanup_free_ char *sigfile = sig_for(file);
+    _cleanup_close_ int fd = openat(rootfd, file, O_RDONLY);
+
+    gpgerr = gpgme_data_new_from_fd(&in, fd);
+    if (gpgerr) {
+        gpgme_warn(gpgerr, "error reading %s", file);
+        return -1;
+    }
+
+    sig = sign_data(ctx, in, &len);
+    gpgme_data_release(in);
+    if (!sig) {
+        warnx("failed to get the signature for %s", file);
+        return -1;
+    }
+
+    _cleanup_close_ int sigfd = openat(rootfd, sigfile, O_CREAT | O_WRONLY | O_TRUNC, 00644);
+    if (sigfd < 0) {
+        warn("failed to open %s", sigfile);
+        gpgme_free(sig);
+        return -1;
+    }
+
+    while (written < len) {
+        ssize_t nbytes_w = write(sigfd, &sig[written], len - written);
+        if (nbytes_w < 0) {
+            warn("failed to write %s", sigfile);
+            gpgme_free(sig);
+            return -1;
+        }
+        written += nbytes_w;
+    }
+
+    gpgme_free(sig);
+    return 0;
+}
+
+unsigned char *signer_sign_memory(struct signer *signer, const void *data, size_t len,
+                                  size_t *siglen)
 {
     gpgme_error_t err;
+    gpgme_data_t in;
     gpgme_ctx_t ctx;
-    gpgme_data_t in, out;
-    gpgme_sign_result_t result;
+    unsigned char *sig;
+    char *mem;
+
+    /* gpgme reads straight from the caller's buffer, no copy */
+    err = gpgme_data_new_from_mem(&in, data, len, 0);
+    if (gpg_err_code(err) != GPG_ERR_NO_ERROR) {
+        gpgme_warn(err, "failed to call gpgme_data_new_from_mem()");
+        return NULL;
+    }
 
-    if (init_gpgme() < 0)
-        return;
+    ctx = signer_acquire(signer);
+    mem = sign_data(ctx, in, siglen);
+    signer_release(signer, ctx);
 
-    err = gpgme_new(&ctx);
-    if (gpg_err_code(err) != GPG_ERR_NO_ERROR)
-        gpgme_err(EXIT_FAILURE, err, "failed to call gpgme_new()");
+    gpgme_data_release(in);
+    if (!mem)
+        return NULL;
+
+    /* hand back memory the caller can free() */
+    sig = malloc(*siglen);
+    if (sig)
+        memcpy(sig, mem, *siglen);
+    gpgme_free(mem);
 
-    if (key) {
-        gpgme_key_t akey;
+    return sig;
+}
 
-        err = gpgme_get_key(ctx, key, &akey, 1);
-        if (err)
-            gpgme_err(EXIT_FAILURE, err, "failed to set key %s", key);
+static void *sign_worker(void *arg)
+{
+    struct batch *batch = arg;
 
-        err = gpgme_signers_add(ctx, akey);
-        if (gpg_err_code(err) != GPG_ERR_NO_ERROR)
-            gpgme_err(EXIT_FAILURE, err, "failed to call gpgme_signers_add()");
+    for (;;) {
+        size_t i = atomic_fetch_add(&batch->next, 1);
+        if (i >= batch->count)
+            break;
 
-        gpgme_key_unref(akey);
+        gpgme_ctx_t ctx = signer_acquire(batch->signer);
+        if (sign_file(ctx, batch->rootfd, batch->files[i]) < 0)
+            batch->failed = true;
+        signer_release(batch->signer, ctx);
     }
 
-    _cleanup_free_ char *sigfile = sig_for(file);
-    _cleanup_close_ int sigfd = openat(rootfd, sigfile, O_CREAT | O_WRONLY, 00644);
-    _cleanup_close_ int fd = openat(rootfd, file, O_RDONLY);
+    return NULL;
+}
 
-    err = gpgme_data_new_from_fd(&in, fd);
-    if (err)
-        gpgme_err(EXIT_FAILURE, err, "error reading %s", file);
+static void *verify_worker(void *arg)
+{
+    struct batch *batch = arg;
 
-    err = gpgme_data_new(&out);
-    if (gpg_err_code(err) != GPG_ERR_NO_ERROR)
-        gpgme_err(EXIT_FAILURE, err, "failed to call gpgme_data_new()");
+    for (;;) {
+        size_t i = atomic_fetch_add(&batch->next, 1);
+        if (i >= batch->count)
+            break;
+
+        gpgme_ctx_t ctx = signer_acquire(batch->signer);
+        if (verify_file(ctx, batch->rootfd, batch->files[i]) < 0)
+            batch->failed = true;
+        signer_release(batch->signer, ctx);
+    }
 
-    err = gpgme_op_sign(ctx, in, out, GPGME_SIG_MODE_DETACH);
-    if (err)
-        gpgme_err(EXIT_FAILURE, err, "signing failed");
+    return NULL;
+}
+
+struct check_batch {
+    struct signer *signer;
+    struct signed_file *files;
+    size_t count;
+    atomic_size_t next;
+};
 
-    result = gpgme_op_sign_result(ctx);
-    if (!result)
-        gpgme_err(EXIT_FAILURE, err, "signaure failed?");
+static void *check_worker(void *arg)
+{
+    struct check_batch *batch = arg;
 
-    char buf[BUFSIZ];
-    int ret;
+    for (;;) {
+        size_t i = atomic_fetch_add(&batch->next, 1);
+        if (i >= batch->count)
+            break;
 
-    ret = gpgme_data_seek(out, 0, SEEK_SET);
-    if (ret)
-        return;
+        struct signed_file *file = &batch->files[i];
+        gpgme_ctx_t ctx = signer_acquire(batch->signer);
+        file->result = verify_file(ctx, file->dirfd, file->path);
+        signer_release(batch->signer, ctx);
+    }
 
-    while ((ret = gpgme_data_read(out, buf, BUFSIZ)) > 0)
-        write(sigfd, buf, ret);
+    return NULL;
+}
 
-    gpgme_data_release(out);
-    gpgme_data_release(in);
-    gpgme_release(ctx);
+void signer_verify_each(struct signer *signer, struct signed_file *files, size_t count)
+{
+    struct check_batch batch = {
+        .signer = signer,
+        .files  = files,
+        .count  = count
+    };
+
+    if (count)
+        run_parallel(count < signer->count ? count : signer->count, check_worker, &batch);
+}
+
+static inline unsigned int batch_workers(const struct batch *batch)
+{
+    return batch->count < batch->signer->count ? batch->count : batch->signer->count;
+}
+
+int signer_sign_files(struct signer *signer, int rootfd,
+                      const char *const *files, size_t count)
+{
+    struct batch batch = {
+        .signer = signer,
+        .rootfd = rootfd,
+        .files  = files,
+        .count  = count
+    };
+
+    if (count)
+        run_parallel(batch_workers(&batch), sign_worker, &batch);
+    return batch.failed ? -1 : 0;
+}
+
+static void *verify_thread(void *arg)
+{
+    struct verification *v = arg;
+
+    stats_attach(v->stats);
+    run_parallel(batch_workers(&v->batch), verify_worker, &v->batch);
+    return NULL;
+}
+
+struct verification *signer_verify_start(struct signer *signer, int rootfd,
+                                         const char *const *files, size_t count)
+{
+    struct verification *v = calloc(1, sizeof(struct verification));
+    if (!v)
+        return NULL;
+
+    /* the caller's array may not outlive this call */
+    if (count) {
+        v->files = malloc(count * sizeof(char *));
+        if (!v->files) {
+            free(v);
+            return NULL;
+        }
+        memcpy(v->files, files, count * sizeof(char *));
+    }
+
+    v->batch = (struct batch){
+        .signer = signer,
+        .rootfd = rootfd,
+        .files  = v->files,
+        .count  = count
+    };
+
+    v->stats = stats_attached();
+
+    /* if a thread can't be had, just do the work now */
+    v->threaded = count && pthread_create(&v->thread, NULL, verify_thread, v) == 0;
+    if (count && !v->threaded)
+        verify_thread(v);
+
+    return v;
+}
+
+int signer_verify_finish(struct verification *v)
+{
+    int rc;
+
+    if (v->threaded)
+        pthread_join(v->thread, NULL);
+
+    rc = v->batch.failed ? -1 : 0;
+    free(v->files);
+    free(v);
+    return rc;
 }
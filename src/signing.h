@@ -18,7 +18,44 @@
 #ifndef SIGNING_H
 #define SIGNING_H
 
-void gpgme_sign(int rootfd, const char *file, const char *key);
-int gpgme_verify(int rootfd, const char *file);
+#include <stddef.h>
+
+struct signer;
+struct verification;
+
+struct signed_file {
+    int dirfd;
+    const char *path;
+    int result;
+};
+
+/* A pool of gpgme contexts kept for the whole run, all signing with the
+ * same key, which is only looked up once. A NULL key means gpg's
+ * default. Each context handles one operation at a time, so the pool's
+ * size bounds how many run at once. */
+struct signer *signer_new(const char *key, size_t contexts);
+void signer_free(struct signer *signer);
+
+/* Write a detached signature for each file, in parallel. Returns -1 if
+ * any of them couldn't be signed. */
+int signer_sign_files(struct signer *signer, int rootfd,
+                      const char *const *files, size_t count);
+
+/* Make a detached, binary signature of len bytes of data. The result
+ * is allocated with malloc(). */
+unsigned char *signer_sign_memory(struct signer *signer, const void *data, size_t len,
+                                  size_t *siglen);
+
+/* Check the detached signatures of files on a background thread, so it
+ * can overlap other work. Finishing waits for it, and returns -1 if any
+ * signature didn't check out. */
+struct verification *signer_verify_start(struct signer *signer, int rootfd,
+                                         const char *const *files, size_t count);
+int signer_verify_finish(struct verification *verification);
+
+/* Check the detached signature of each file in parallel, leaving 0 in
+ * its result if it's good and -1 otherwise, a missing signature
+ * included. */
+void signer_verify_each(struct signer *signer, struct signed_file *files, size_t count);
 
 #endif
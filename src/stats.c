@@ -0,0 +1,261 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#include "stats.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#define MAX_DEPTH 8
+
+struct phase_stats {
+    atomic_uint_fast64_t wall;
+    atomic_uint_fast64_t cpu;
+    atomic_uint_fast64_t bytes_read;
+    atomic_uint_fast64_t files_opened;
+    /* the process's high-water mark as the phase ended, which the
+     * kernel only keeps for the whole run, not per phase */
+    long process_peak_rss;
+};
+
+static const char *phase_names[PHASE_MAX] = {
+    [PHASE_INIT]       = "init_repo",
+    [PHASE_LOAD_DB]    = "load_database",
+    [PHASE_ENUMERATE]  = "enumerate_pool",
+    [PHASE_PARSE]      = "parse_packages",
+    [PHASE_HASH]       = "hash_packages",
+    [PHASE_SIGNATURES] = "load_signatures",
+    [PHASE_FORMAT]     = "format_database",
+    [PHASE_COMPRESS]   = "compress_database",
+    [PHASE_SIGN]       = "sign_database",
+    [PHASE_LINK]       = "link_database"
+};
+
+struct stats {
+    struct phase_stats phases[PHASE_MAX];
+    atomic_ulong counters[COUNTER_MAX];
+
+    enum phase stack[MAX_DEPTH];
+    int depth;
+    _Atomic int current;
+
+    uint64_t wall_start;
+    uint64_t cpu_start;
+    /* CPU that timers have already charged elsewhere, which the process
+     * clock counts too */
+    atomic_uint_fast64_t timed_cpu;
+    uint64_t timed_start;
+};
+
+static _Thread_local struct stats *attached;
+
+static uint64_t now(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void charge_current(struct stats *stats)
+{
+    uint64_t wall = now(CLOCK_MONOTONIC), cpu = now(CLOCK_PROCESS_CPUTIME_ID);
+    uint64_t timed = stats->timed_cpu;
+
+    if (stats->depth > 0) {
+        struct phase_stats *p = &stats->phases[stats->stack[stats->depth - 1]];
+        uint64_t spent = cpu - stats->cpu_start, elsewhere = timed - stats->timed_start;
+
+        atomic_fetch_add(&p->wall, wall - stats->wall_start);
+        atomic_fetch_add(&p->cpu, spent > elsewhere ? spent - elsewhere : 0);
+    }
+
+    stats->wall_start = wall;
+    stats->cpu_start = cpu;
+    stats->timed_start = timed;
+}
+
+static long process_peak_rss(void)
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) < 0)
+        return 0;
+    return usage.ru_maxrss * 1024;
+}
+
+struct stats *stats_new(void)
+{
+    struct stats *stats = calloc(1, sizeof(struct stats));
+    if (stats)
+        stats->current = -1;
+    return stats;
+}
+
+void stats_free(struct stats *stats)
+{
+    if (attached == stats)
+        attached = NULL;
+    free(stats);
+}
+
+void stats_attach(struct stats *stats)
+{
+    attached = stats;
+}
+
+struct stats *stats_attached(void)
+{
+    return attached;
+}
+
+void stats_begin(enum phase phase)
+{
+    struct stats *stats = attached;
+
+    if (!stats || stats->depth == MAX_DEPTH)
+        return;
+
+    charge_current(stats);
+    stats->stack[stats->depth++] = phase;
+    stats->current = phase;
+}
+
+void stats_end(enum phase phase)
+{
+    struct stats *stats = attached;
+
+    if (!stats || stats->depth == 0 || stats->stack[stats->depth - 1] != phase)
+        return;
+
+    charge_current(stats);
+    stats->phases[phase].process_peak_rss = process_peak_rss();
+    stats->current = --stats->depth > 0 ? (int)stats->stack[stats->depth - 1] : -1;
+}
+
+void stats_timer_start(struct stats_timer *timer)
+{
+    if (!attached)
+        return;
+
+    timer->wall = now(CLOCK_MONOTONIC);
+    timer->cpu = now(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void stats_timer_stop(struct stats_timer *timer, enum phase phase)
+{
+    struct stats *stats = attached;
+
+    if (!stats)
+        return;
+
+    uint64_t cpu = now(CLOCK_THREAD_CPUTIME_ID) - timer->cpu;
+
+    atomic_fetch_add(&stats->phases[phase].wall, now(CLOCK_MONOTONIC) - timer->wall);
+    atomic_fetch_add(&stats->phases[phase].cpu, cpu);
+    atomic_fetch_add(&stats->timed_cpu, cpu);
+}
+
+void stats_open(void)
+{
+    struct stats *stats = attached;
+    int current = stats ? stats->current : -1;
+
+    if (current >= 0)
+        atomic_fetch_add(&stats->phases[current].files_opened, 1);
+}
+
+void stats_read(size_t bytes)
+{
+    struct stats *stats = attached;
+    int current = stats ? stats->current : -1;
+
+    if (current >= 0)
+        atomic_fetch_add(&stats->phases[current].bytes_read, bytes);
+}
+
+void stats_count(enum counter counter)
+{
+    struct stats *stats = attached;
+
+    if (stats)
+        atomic_fetch_add(&stats->counters[counter], 1);
+}
+
+const char *stats_phase_name(enum phase phase)
+{
+    return phase_names[phase];
+}
+
+double stats_phase_seconds(const struct stats *stats, enum phase phase)
+{
+    return (uint64_t)stats->phases[phase].wall / 1e9;
+}
+
+unsigned long stats_counter(const struct stats *stats, enum counter counter)
+{
+    return stats->counters[counter];
+}
+
+static void print_text(const struct stats *stats, FILE *out)
+{
+    int i;
+
+    fprintf(out, "%-18s %10s %10s %12s %8s %12s\n",
+            "phase", "wall", "cpu", "read", "opened", "rss so far");
+
+    for (i = 0; i < PHASE_MAX; ++i) {
+        const struct phase_stats *p = &stats->phases[i];
+
+        fprintf(out, "%-18s %9.3fs %9.3fs %10.1fMi %8lu %10.1fMi\n",
+                phase_names[i], (uint64_t)p->wall / 1e9, (uint64_t)p->cpu / 1e9,
+                (uint64_t)p->bytes_read / 1048576.0,
+                (unsigned long)p->files_opened,
+                p->process_peak_rss / 1048576.0);
+    }
+}
+
+static void print_json(const struct stats *stats, FILE *out)
+{
+    int i;
+
+    fputs("{\"phases\":{", out);
+    for (i = 0; i < PHASE_MAX; ++i) {
+        const struct phase_stats *p = &stats->phases[i];
+
+        fprintf(out, "%s\"%s\":{\"wall_seconds\":%.9f,\"cpu_seconds\":%.9f,"
+                "\"bytes_read\":%lu,\"files_opened\":%lu,\"process_peak_rss_bytes\":%ld}",
+                i ? "," : "", phase_names[i], (uint64_t)p->wall / 1e9, (uint64_t)p->cpu / 1e9,
+                (unsigned long)p->bytes_read, (unsigned long)p->files_opened,
+                p->process_peak_rss);
+    }
+    fputs("}}\n", out);
+}
+
+void stats_print(const struct stats *stats, FILE *out, enum stats_format format)
+{
+    switch (format) {
+    case STATS_TEXT:
+        print_text(stats, out);
+        break;
+    case STATS_JSON:
+        print_json(stats, out);
+        break;
+    }
+}
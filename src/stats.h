@@ -0,0 +1,96 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum phase {
+    PHASE_INIT,
+    PHASE_LOAD_DB,
+    PHASE_ENUMERATE,
+    PHASE_PARSE,
+    PHASE_HASH,
+    PHASE_SIGNATURES,
+    PHASE_FORMAT,
+    PHASE_COMPRESS,
+    PHASE_SIGN,
+    PHASE_LINK,
+    PHASE_MAX
+};
+
+enum counter {
+    COUNTER_CHECKSUM_HIT,
+    COUNTER_CHECKSUM_MISS,
+    COUNTER_SIGNATURE_HIT,
+    COUNTER_SIGNATURE_MISS,
+    COUNTER_FILES_HIT,
+    COUNTER_FILES_MISS,
+    COUNTER_MAX
+};
+
+struct stats_timer {
+    uint64_t wall;
+    uint64_t cpu;
+};
+
+enum stats_format {
+    STATS_TEXT,
+    STATS_JSON
+};
+
+struct stats;
+
+/* Each repo collects into its own stats, if asked to. */
+struct stats *stats_new(void);
+void stats_free(struct stats *stats);
+
+/* Collect into stats from the calling thread, or stop with NULL. Threads
+ * started by run_parallel() and the database writer carry on with their
+ * starter's. With nothing attached, every call below returns right
+ * away. */
+void stats_attach(struct stats *stats);
+struct stats *stats_attached(void);
+
+/* Phases nest, and time is charged only to the innermost one, so a
+ * phase's numbers never include its children's. Only the thread
+ * working the repo should begin and end phases; work done by other
+ * threads in the meantime is charged to whatever phase it's in. CPU
+ * time is the process's, so repos busy at the same time are each
+ * charged for the others' too. */
+void stats_begin(enum phase phase);
+void stats_end(enum phase phase);
+
+/* For work done off the repo's thread: the timer measures the calling
+ * thread's own wall and CPU time and charges it straight to the given
+ * phase, independently of the phase stack. Its CPU time is then left
+ * out of the phase the repo's thread is in, so it isn't counted twice. */
+void stats_timer_start(struct stats_timer *timer);
+void stats_timer_stop(struct stats_timer *timer, enum phase phase);
+
+void stats_open(void);
+void stats_read(size_t bytes);
+void stats_count(enum counter counter);
+
+const char *stats_phase_name(enum phase phase);
+double stats_phase_seconds(const struct stats *stats, enum phase phase);
+unsigned long stats_counter(const struct stats *stats, enum counter counter);
+
+void stats_print(const struct stats *stats, FILE *out, enum stats_format format);
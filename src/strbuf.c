@@ -75,6 +75,38 @@ int buffer_putc(buffer_t *buf, const char c)
     return 0;
 }
 
+int buffer_reserve(buffer_t *buf, size_t len)
+{
+    return buffer_extendby(buf, len + 1) < 0 ? -errno : 0;
+}
+
+int buffer_append(buffer_t *buf, const char *data, size_t len)
+{
+    if (buffer_extendby(buf, len + 1) < 0)
+        return -errno;
+
+    memcpy(&buf->data[buf->len], data, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+    return 0;
+}
+
+int buffer_append_long(buffer_t *buf, long val)
+{
+    char digits[24], *p = &digits[sizeof(digits)];
+    unsigned long uval = val < 0 ? -(unsigned long)val : (unsigned long)val;
+
+    do {
+        *--p = '0' + uval % 10;
+        uval /= 10;
+    } while (uval);
+
+    if (val < 0)
+        *--p = '-';
+
+    return buffer_append(buf, p, &digits[sizeof(digits)] - p);
+}
+
 ssize_t buffer_printf(buffer_t *buf, const char *fmt, ...)
 {
     size_t len = buf->buflen - buf->len;
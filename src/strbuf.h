@@ -19,6 +19,7 @@
 
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 #include <sys/types.h>
 
 typedef struct buffer {
@@ -31,5 +32,9 @@ int buffer_init(buffer_t *buf, size_t reserve);
 void buffer_clear(buffer_t *buf);
 static inline void buffer_free(buffer_t *buf) { free(buf->data); }
 
+int buffer_reserve(buffer_t *buf, size_t len);
 int buffer_putc(buffer_t *buf, const char c);
+int buffer_append(buffer_t *buf, const char *data, size_t len);
+int buffer_append_long(buffer_t *buf, long val);
+static inline int buffer_append_str(buffer_t *buf, const char *str) { return buffer_append(buf, str, strlen(str)); }
 ssize_t buffer_printf(buffer_t *buf, const char *fmt, ...) __attribute__((format (printf, 2, 3)));
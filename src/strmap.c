@@ -0,0 +1,114 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#include "strmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "pkghash.h"
+#include "util.h"
+
+static inline size_t next_power(size_t x)
+{
+    return x < 2 ? 2 : 1UL << (64 - __builtin_clzl(x - 1));
+}
+
+struct strmap *strmap_new(size_t size)
+{
+    struct strmap *map = malloc(sizeof(struct strmap));
+    if (!map)
+        return NULL;
+
+    /* keep the table at most half full */
+    map->buckets = next_power(size * 2);
+    map->entries = 0;
+    map->table = calloc(map->buckets, sizeof(struct strmap_entry));
+    if (!map->table) {
+        free(map);
+        return NULL;
+    }
+
+    return map;
+}
+
+void strmap_free(struct strmap *map)
+{
+    if (map)
+        free(map->table);
+    free(map);
+}
+
+static struct strmap_entry *find_slot(struct strmap_entry *table, size_t buckets,
+                                      const char *key, unsigned long hash)
+{
+    size_t position = hash & (buckets - 1);
+
+    while (table[position].key) {
+        if (table[position].hash == hash && streq(table[position].key, key))
+            break;
+        position = (position + 1) & (buckets - 1);
+    }
+
+    return &table[position];
+}
+
+static int grow(struct strmap *map)
+{
+    size_t i, buckets = map->buckets * 2;
+    struct strmap_entry *table = calloc(buckets, sizeof(struct strmap_entry));
+    if (!table)
+        return -errno;
+
+    for (i = 0; i < map->buckets; ++i) {
+        const struct strmap_entry *e = &map->table[i];
+        if (e->key)
+            *find_slot(table, buckets, e->key, e->hash) = *e;
+    }
+
+    free(map->table);
+    map->table = table;
+    map->buckets = buckets;
+    return 0;
+}
+
+int strmap_insert(struct strmap *map, const char *key, void *value)
+{
+    unsigned long hash = _alpm_hash_sdbm(key);
+    struct strmap_entry *slot;
+
+    if ((map->entries + 1) * 2 > map->buckets && grow(map) < 0)
+        return -errno;
+
+    slot = find_slot(map->table, map->buckets, key, hash);
+    if (!slot->key)
+        map->entries++;
+
+    *slot = (struct strmap_entry){ .hash = hash, .key = key, .value = value };
+    return 0;
+}
+
+void *strmap_find_hashed(const struct strmap *map, const char *key, unsigned long hash)
+{
+    return find_slot(map->table, map->buckets, key, hash)->value;
+}
+
+void *strmap_find(const struct strmap *map, const char *key)
+{
+    return strmap_find_hashed(map, key, _alpm_hash_sdbm(key));
+}
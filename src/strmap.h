@@ -0,0 +1,41 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+struct strmap_entry {
+    unsigned long hash;
+    const char *key;
+    void *value;
+};
+
+/* A small open addressing table keyed by strings. Keys are not copied
+ * and must outlive the map. */
+struct strmap {
+    struct strmap_entry *table;
+    size_t buckets;
+    size_t entries;
+};
+
+struct strmap *strmap_new(size_t size);
+void strmap_free(struct strmap *map);
+
+int strmap_insert(struct strmap *map, const char *key, void *value);
+void *strmap_find(const struct strmap *map, const char *key);
+void *strmap_find_hashed(const struct strmap *map, const char *key, unsigned long hash);
@@ -0,0 +1,102 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#include "tar.h"
+
+#include <stdint.h>
+#include <string.h>
+
+struct ustar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+_Static_assert(sizeof(struct ustar_header) == TAR_BLOCK, "ustar header isn't a block");
+
+/* zero padded octal, filling all but the last byte of the field, which
+ * is left as the terminating NUL */
+static int format_octal(char *field, size_t width, uint64_t value)
+{
+    size_t i = width - 1;
+
+    field[i] = '\0';
+    while (i--) {
+        field[i] = '0' + (value & 7);
+        value >>= 3;
+    }
+
+    return value ? -1 : 0;
+}
+
+int tar_header(char *block, const char *path, size_t size, time_t mtime)
+{
+    struct ustar_header *h = (struct ustar_header *)block;
+    size_t len = strlen(path), i;
+    unsigned int sum = 0;
+
+    memset(h, 0, sizeof(*h));
+
+    if (len <= sizeof(h->name)) {
+        memcpy(h->name, path, len);
+    } else {
+        const char *slash = strrchr(path, '/');
+        if (!slash || !tar_fits(slash - path, len - (slash - path) - 1))
+            return -1;
+
+        memcpy(h->prefix, path, slash - path);
+        memcpy(h->name, slash + 1, len - (slash - path) - 1);
+    }
+
+    format_octal(h->mode, sizeof(h->mode), 0644);
+    format_octal(h->uid, sizeof(h->uid), 0);
+    format_octal(h->gid, sizeof(h->gid), 0);
+    format_octal(h->devmajor, sizeof(h->devmajor), 0);
+    format_octal(h->devminor, sizeof(h->devminor), 0);
+    if (format_octal(h->size, sizeof(h->size), size) < 0)
+        return -1;
+    if (format_octal(h->mtime, sizeof(h->mtime), mtime < 0 ? 0 : (uint64_t)mtime) < 0)
+        return -1;
+
+    h->typeflag = '0';
+    memcpy(h->magic, "ustar", 6);
+    memcpy(h->version, "00", 2);
+
+    /* the checksum is taken with its own field as spaces, and stored
+     * as six digits, a NUL and a space */
+    memset(h->chksum, ' ', sizeof(h->chksum));
+    for (i = 0; i < TAR_BLOCK; ++i)
+        sum += (unsigned char)block[i];
+
+    format_octal(h->chksum, 7, sum);
+    h->chksum[7] = ' ';
+    return 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define TAR_BLOCK  512
+#define TAR_RECORD 10240
+
+/* Whether "dir/name" can be stored in a plain ustar header, either
+ * whole or split across the prefix and name fields. */
+static inline bool tar_fits(size_t dirlen, size_t namelen)
+{
+    return dirlen + 1 + namelen <= 100 || (dirlen <= 155 && namelen <= 100);
+}
+
+/* bytes of zero padding needed after a member's data */
+static inline size_t tar_padding(size_t size)
+{
+    return -size & (TAR_BLOCK - 1);
+}
+
+/* Fill in a ustar header block for a regular file, owned by root and
+ * mode 0644. Returns -1 if the path or size can't be represented. */
+int tar_header(char *block, const char *path, size_t size, time_t mtime);
@@ -25,9 +25,12 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <openssl/md5.h>
 #include <openssl/sha.h>
 
+#include "stats.h"
+
 #define WHITESPACE " \t\n\r"
 
 char *joinstring(const char *root, ...)
@@ -122,6 +125,7 @@ static char *md5_fd(int fd)
     while ((n = read(fd, buf, sizeof(buf))) > 0 || errno == EINTR) {
         if (n < 0)
             continue;
+        stats_read(n);
         MD5_Update(&ctx, buf, n);
     }
 
@@ -143,6 +147,7 @@ static char *sha2_fd(int fd)
     while ((n = read(fd, buf, sizeof(buf))) > 0 || errno == EINTR) {
         if (n < 0)
             continue;
+        stats_read(n);
         SHA256_Update(&ctx, buf, n);
     }
 
@@ -153,15 +158,33 @@ static char *sha2_fd(int fd)
     return hex_representation(output, 32);
 }
 
+char *md5_memory(const void *data, size_t len)
+{
+    unsigned char output[16];
+
+    MD5(data, len, output);
+    return hex_representation(output, 16);
+}
+
+char *sha256_memory(const void *data, size_t len)
+{
+    unsigned char output[32];
+
+    SHA256(data, len, output);
+    return hex_representation(output, 32);
+}
+
 char *md5_file(int dirfd, char *filename)
 {
     _cleanup_close_ int fd = openat(dirfd, filename, O_RDONLY);
+    stats_open();
     return md5_fd(fd);
 }
 
 char *sha256_file(int dirfd, char *filename)
 {
     _cleanup_close_ int fd = openat(dirfd, filename, O_RDONLY);
+    stats_open();
     return sha2_fd(fd);
 }
 
@@ -178,3 +201,42 @@ char *strstrip(char *s)
     *e = 0;
     return s;
 }
+
+unsigned int nr_workers(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+}
+
+struct parallel {
+    void *(*fn)(void *);
+    void *arg;
+    struct stats *stats;
+};
+
+static void *parallel_start(void *arg)
+{
+    const struct parallel *p = arg;
+
+    stats_attach(p->stats);
+    return p->fn(p->arg);
+}
+
+void run_parallel(unsigned int workers, void *(*fn)(void *), void *arg)
+{
+    struct parallel p = { fn, arg, stats_attached() };
+    pthread_t threads[workers];
+    unsigned int i, started = 0;
+
+    /* the calling thread always does its share of the work */
+    for (i = 1; i < workers; ++i) {
+        if (pthread_create(&threads[i], NULL, parallel_start, &p) != 0)
+            break;
+        ++started;
+    }
+
+    fn(arg);
+
+    for (i = 1; i <= started; ++i)
+        pthread_join(threads[i], NULL);
+}
@@ -48,5 +48,10 @@ int xstrtoul(const char *str, unsigned long *out);
 
 char *md5_file(int dirfd, char *filename);
 char *sha256_file(int dirfd, char *filename);
+char *md5_memory(const void *data, size_t len);
+char *sha256_memory(const void *data, size_t len);
 
 char *strstrip(char *s);
+
+unsigned int nr_workers(void);
+void run_parallel(unsigned int workers, void *(*fn)(void *), void *arg);
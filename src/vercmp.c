@@ -0,0 +1,248 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#include "vercmp.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* libalpm classifies with the ctype functions; in the locales it runs
+ * under, only ASCII letters and digits count */
+static inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+static inline bool is_alpha(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+static inline bool is_alnum(char c) { return is_digit(c) || is_alpha(c); }
+
+static size_t count_segments(const char *str, size_t len)
+{
+    size_t i = 0, count = 0;
+
+    while (i < len) {
+        while (i < len && !is_alnum(str[i]))
+            ++i;
+        if (i == len)
+            break;
+
+        ++count;
+        if (is_digit(str[i])) {
+            while (i < len && is_digit(str[i]))
+                ++i;
+        } else {
+            while (i < len && is_alpha(str[i]))
+                ++i;
+        }
+    }
+
+    return count;
+}
+
+static void split_segments(struct verpart *part, struct verseg *segs,
+                           const char *str, size_t len)
+{
+    size_t i = 0;
+
+    *part = (struct verpart){ .segs = segs };
+
+    while (i < len) {
+        size_t start = i;
+        struct verseg *seg;
+
+        while (i < len && !is_alnum(str[i]))
+            ++i;
+        if (i == len) {
+            part->trail = i - start;
+            break;
+        }
+
+        seg = &segs[part->count++];
+        seg->sep = i - start;
+        seg->numeric = is_digit(str[i]);
+
+        if (seg->numeric) {
+            while (i < len && str[i] == '0')
+                ++i;
+            seg->str = &str[i];
+            while (i < len && is_digit(str[i]))
+                ++i;
+        } else {
+            seg->str = &str[i];
+            while (i < len && is_alpha(str[i]))
+                ++i;
+        }
+
+        seg->len = &str[i] - seg->str;
+    }
+}
+
+int version_parse(struct version *v, const char *str)
+{
+    const char *s = str, *version, *release;
+    size_t ver_len, rel_len = 0, count;
+    struct verseg *segs;
+
+    *v = (struct version){ .epoch = "", .epoch_len = 0 };
+
+    /* epoch is optional, and only counts if it's followed by a colon */
+    while (is_digit(*s))
+        ++s;
+
+    release = strrchr(s, '-');
+    if (*s == ':') {
+        v->epoch = str;
+        v->epoch_len = s - str;
+        while (v->epoch_len && *v->epoch == '0') {
+            ++v->epoch;
+            --v->epoch_len;
+        }
+        version = s + 1;
+    } else {
+        version = str;
+    }
+
+    if (release) {
+        ver_len = release - version;
+        ++release;
+        rel_len = strlen(release);
+        v->has_rel = true;
+    } else {
+        ver_len = strlen(version);
+    }
+
+    count = count_segments(version, ver_len);
+    if (release)
+        count += count_segments(release, rel_len);
+
+    segs = malloc((count ? count : 1) * sizeof(struct verseg));
+    if (!segs)
+        return -1;
+
+    split_segments(&v->ver, segs, version, ver_len);
+    if (release)
+        split_segments(&v->rel, &segs[v->ver.count], release, rel_len);
+
+    return 0;
+}
+
+void version_free(struct version *v)
+{
+    free(v->ver.segs);
+    v->ver.segs = NULL;
+}
+
+static int compare_numbers(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    int rc;
+
+    if (a_len != b_len)
+        return a_len < b_len ? -1 : 1;
+
+    rc = memcmp(a, b, a_len);
+    return rc < 0 ? -1 : rc > 0;
+}
+
+static int compare_strings(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    int rc = memcmp(a, b, a_len < b_len ? a_len : b_len);
+
+    if (rc)
+        return rc < 0 ? -1 : 1;
+    if (a_len != b_len)
+        return a_len < b_len ? -1 : 1;
+    return 0;
+}
+
+enum tail {
+    TAIL_END,
+    TAIL_ALPHA,
+    TAIL_OTHER
+};
+
+/* what's left of a part after its first k segments, as rpmvercmp sees
+ * it: either still in front of the separators, or just past them */
+static enum tail tail_at(const struct verpart *p, size_t k, bool skipped)
+{
+    if (k < p->count) {
+        if (!skipped && p->segs[k].sep)
+            return TAIL_OTHER;
+        return p->segs[k].numeric ? TAIL_OTHER : TAIL_ALPHA;
+    }
+
+    return !skipped && p->trail ? TAIL_OTHER : TAIL_END;
+}
+
+/* A replay of rpmvercmp() over pre-split segments, down to its quirks:
+ * differing separator lengths decide the comparison, a number beats a
+ * letter, and what's left over decides ties at the end. */
+static int compare_parts(const struct verpart *a, const struct verpart *b)
+{
+    enum tail ta, tb;
+    size_t k;
+
+    for (k = 0;; ++k) {
+        const struct verseg *sa, *sb;
+        int rc;
+
+        /* rpmvercmp stops as soon as either string is exhausted */
+        ta = tail_at(a, k, false);
+        tb = tail_at(b, k, false);
+        if (ta == TAIL_END || tb == TAIL_END)
+            break;
+
+        /* or, after skipping the separators, when either has no more
+         * segments */
+        if (k == a->count || k == b->count) {
+            ta = tail_at(a, k, true);
+            tb = tail_at(b, k, true);
+            break;
+        }
+
+        sa = &a->segs[k];
+        sb = &b->segs[k];
+
+        if (sa->sep != sb->sep)
+            return sa->sep < sb->sep ? -1 : 1;
+
+        if (sa->numeric != sb->numeric)
+            return sa->numeric ? 1 : -1;
+
+        rc = sa->numeric
+            ? compare_numbers(sa->str, sa->len, sb->str, sb->len)
+            : compare_strings(sa->str, sa->len, sb->str, sb->len);
+        if (rc)
+            return rc;
+    }
+
+    if (ta == TAIL_END && tb == TAIL_END)
+        return 0;
+
+    /* a leftover alpha string never beats an empty one */
+    if ((ta == TAIL_END && tb != TAIL_ALPHA) || ta == TAIL_ALPHA)
+        return -1;
+    return 1;
+}
+
+int version_cmp(const struct version *a, const struct version *b)
+{
+    int ret = compare_numbers(a->epoch, a->epoch_len, b->epoch, b->epoch_len);
+
+    if (ret == 0) {
+        ret = compare_parts(&a->ver, &b->ver);
+        if (ret == 0 && a->has_rel && b->has_rel)
+            ret = compare_parts(&a->rel, &b->rel);
+    }
+
+    return ret;
+}
@@ -0,0 +1,54 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Simon Gomizelj, 2014
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* A run of digits or letters, and the separators before it. Numbers
+ * have their leading zeros stripped. */
+struct verseg {
+    const char *str;
+    size_t len;
+    size_t sep;
+    bool numeric;
+};
+
+struct verpart {
+    struct verseg *segs;
+    size_t count;
+    /* separators after the last segment */
+    size_t trail;
+};
+
+/* A version string split into epoch, version and release up front, so
+ * that comparing two doesn't have to tokenize them again. Points into
+ * the string it was parsed from, which must outlive it. */
+struct version {
+    const char *epoch;
+    size_t epoch_len;
+    struct verpart ver;
+    struct verpart rel;
+    bool has_rel;
+};
+
+int version_parse(struct version *v, const char *str);
+void version_free(struct version *v);
+
+/* Gives the same answer as alpm_pkg_vercmp() on the original strings. */
+int version_cmp(const struct version *a, const struct version *b);